@@ -14,10 +14,12 @@
 #include "selinux/selinux.h"
 #include "kernel_compat.h"
 #include "allowlist.h"
+#include "file_parser.h"
 #include "manager.h"
+#include "timeline.h"
 
-#define FILE_MAGIC 0x7f4b5355 // ' KSU', u32
-#define FILE_FORMAT_VERSION 3 // u32
+#define FILE_MAGIC KSU_ALLOWLIST_MAGIC
+#define FILE_FORMAT_VERSION KSU_ALLOWLIST_VERSION
 
 #define KSU_APP_PROFILE_PRESERVE_UID 9999 // NOBODY_UID
 #define KSU_DEFAULT_SELINUX_DOMAIN "u:r:su:s0"
@@ -397,7 +399,8 @@ void do_load_allow_list(struct work_struct *work)
 	loff_t off = 0;
 	ssize_t ret = 0;
 	struct file *fp = NULL;
-	u32 magic;
+	struct ksu_allowlist_header header;
+	struct app_profile *record = NULL;
 	u32 version;
 
 #ifdef CONFIG_KSU_DEBUG
@@ -413,38 +416,42 @@ void do_load_allow_list(struct work_struct *work)
 	}
 
 	// verify magic
-	if (ksu_kernel_read_compat(fp, &magic, sizeof(magic), &off) !=
-		    sizeof(magic) ||
-	    magic != FILE_MAGIC) {
-		pr_err("allowlist file invalid: %d!\n", magic);
-		goto exit;
-	}
-
-	if (ksu_kernel_read_compat(fp, &version, sizeof(version), &off) !=
-	    sizeof(version)) {
-		pr_err("allowlist read version: %d failed\n", version);
+	if (ksu_kernel_read_compat(fp, &header, sizeof(header), &off) !=
+		    sizeof(header) ||
+	    ksu_parse_allowlist_header(&header, sizeof(header), &version)) {
+		pr_err("allowlist file invalid: %d!\n", header.magic);
 		goto exit;
 	}
 
 	pr_info("allowlist version: %d\n", version);
 
+	record = kmalloc(sizeof(*record), GFP_KERNEL);
+	if (!record)
+		goto exit;
+
 	while (true) {
 		struct app_profile profile;
 
-		ret = ksu_kernel_read_compat(fp, &profile, sizeof(profile),
-					     &off);
+		ret = ksu_kernel_read_compat(fp, record, sizeof(*record), &off);
 
 		if (ret <= 0) {
 			pr_info("load_allow_list read err: %zd\n", ret);
 			break;
 		}
 
+		if (ksu_parse_app_profile(record, ret, &profile)) {
+			pr_err("load_allow_list: skip malformed record\n");
+			continue;
+		}
+
 		pr_info("load_allow_uid, name: %s, uid: %d, allow: %d\n",
 			profile.key, profile.current_uid, profile.allow_su);
 		ksu_set_app_profile(&profile, false);
 	}
 
 exit:
+	kfree(record);
+	ksu_timeline_record(KSU_BOOT_ALLOWLIST_LOADED);
 	ksu_show_allow_list();
 	filp_close(fp, 0);
 }
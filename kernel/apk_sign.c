@@ -1,9 +1,17 @@
+#include <linux/bsearch.h>
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/gfp.h>
+#include <linux/hashtable.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/stat.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #ifdef CONFIG_KSU_DEBUG
 #include <linux/moduleparam.h>
 #endif
@@ -15,272 +23,311 @@
 #endif
 
 #include "apk_sign.h"
+#include "file_parser.h"
 #include "klog.h" // IWYU pragma: keep
+#include "ksu.h"
 #include "kernel_compat.h"
 
 
-struct sdesc {
-	struct shash_desc shash;
-	char ctx[];
+// one sha256 transform for every certificate, shash tfms are safe to
+// share as long as each digest uses its own descriptor
+static struct crypto_shash *sha256_tfm;
+
+static int ksu_sha256(const unsigned char *data, unsigned int datalen,
+		      unsigned char *digest)
+{
+	SHASH_DESC_ON_STACK(desc, sha256_tfm);
+	int ret;
+
+	desc->tfm = sha256_tfm;
+	ret = crypto_shash_digest(desc, data, datalen, digest);
+	shash_desc_zero(desc);
+	return ret;
+}
+
+#define MAX_TRUSTED_CERTS 16
+
+struct trusted_cert {
+	u32 size;
+	u8 digest[SHA256_DIGEST_SIZE];
 };
 
-static struct sdesc *init_sdesc(struct crypto_shash *alg)
+// sorted by (size, digest) for binary search
+static struct trusted_cert trusted_certs[MAX_TRUSTED_CERTS];
+static int trusted_cert_count;
+static u32 trusted_certs_id;
+static DEFINE_MUTEX(apk_sign_init_mutex);
+static bool apk_sign_ready;
+
+static int cmp_trusted_cert(const void *a, const void *b)
 {
-	struct sdesc *sdesc;
-	int size;
-
-	size = sizeof(struct shash_desc) + crypto_shash_descsize(alg);
-	sdesc = kmalloc(size, GFP_KERNEL);
-	if (!sdesc)
-		return ERR_PTR(-ENOMEM);
-	sdesc->shash.tfm = alg;
-	return sdesc;
+	const struct trusted_cert *x = a, *y = b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return memcmp(x->digest, y->digest, SHA256_DIGEST_SIZE);
 }
 
-static int calc_hash(struct crypto_shash *alg, const unsigned char *data,
-		     unsigned int datalen, unsigned char *digest)
+static void add_trusted_cert(u32 size, const char *hash)
 {
-	struct sdesc *sdesc;
-	int ret;
+	struct trusted_cert *cert;
 
-	sdesc = init_sdesc(alg);
-	if (IS_ERR(sdesc)) {
-		pr_info("can't alloc sdesc\n");
-		return PTR_ERR(sdesc);
+	if (trusted_cert_count >= MAX_TRUSTED_CERTS) {
+		pr_err("too many trusted certs, ignore %s\n", hash);
+		return;
 	}
 
-	ret = crypto_shash_digest(&sdesc->shash, data, datalen, digest);
-	kfree(sdesc);
-	return ret;
+	cert = &trusted_certs[trusted_cert_count];
+	if (strlen(hash) != SHA256_DIGEST_SIZE * 2 ||
+	    hex2bin(cert->digest, hash, SHA256_DIGEST_SIZE)) {
+		pr_err("invalid trusted cert hash: %s\n", hash);
+		return;
+	}
+	cert->size = size;
+	trusted_cert_count++;
 }
 
-static int ksu_sha256(const unsigned char *data, unsigned int datalen,
-		      unsigned char *digest)
+#ifdef KSU_EXTRA_CERTS
+// KSU_EXTRA_CERTS: comma separated <size>:<sha256> pairs
+static void add_extra_certs(void)
 {
-	struct crypto_shash *alg;
-	char *hash_alg_name = "sha256";
-	int ret;
+	char *certs = kstrdup(KSU_EXTRA_CERTS, GFP_KERNEL);
+	char *tmp = certs, *entry;
 
-	alg = crypto_alloc_shash(hash_alg_name, 0, 0);
-	if (IS_ERR(alg)) {
-		pr_info("can't alloc alg %s\n", hash_alg_name);
-		return PTR_ERR(alg);
+	if (!certs)
+		return;
+
+	while ((entry = strsep(&tmp, ",")) != NULL) {
+		char *hash = strchr(entry, ':');
+		u32 size;
+
+		if (!*entry) {
+			pr_err("empty trusted cert in KSU_EXTRA_CERTS\n");
+			continue;
+		}
+		if (!hash) {
+			pr_err("invalid trusted cert: %s\n", entry);
+			continue;
+		}
+		*hash++ = '\0';
+		if (kstrtou32(entry, 0, &size)) {
+			pr_err("invalid trusted cert size: %s\n", entry);
+			continue;
+		}
+		add_trusted_cert(size, hash);
 	}
-	ret = calc_hash(alg, data, datalen, digest);
-	crypto_free_shash(alg);
-	return ret;
+
+	kfree(certs);
 }
+#endif
 
-static bool check_block(struct file *fp, u32 *size4, loff_t *pos, u32 *offset,
-			unsigned expected_size, const char *expected_sha256)
+static int apk_sign_prepare(void)
 {
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer-sequence length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signed data length
+	struct crypto_shash *tfm;
+	int ret = 0;
 
-	*offset += 0x4 * 3;
+	if (likely(READ_ONCE(apk_sign_ready)))
+		return 0;
 
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // digests-sequence length
+	mutex_lock(&apk_sign_init_mutex);
+	if (apk_sign_ready)
+		goto out;
 
-	*pos += *size4;
-	*offset += 0x4 + *size4;
-
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // certificates length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // certificate length
-	*offset += 0x4 * 2;
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm)) {
+		pr_err("can't alloc alg sha256: %ld\n", PTR_ERR(tfm));
+		ret = PTR_ERR(tfm);
+		goto out;
+	}
+	sha256_tfm = tfm;
 
-	if (*size4 == expected_size) {
-		*offset += *size4;
+	trusted_cert_count = 0;
+	add_trusted_cert(EXPECTED_SIZE, EXPECTED_HASH);
+#ifdef KSU_EXTRA_CERTS
+	add_extra_certs();
+#endif
+	sort(trusted_certs, trusted_cert_count, sizeof(struct trusted_cert),
+	     cmp_trusted_cert, NULL);
+	trusted_certs_id =
+		full_name_hash(NULL, (const char *)trusted_certs,
+			       trusted_cert_count * sizeof(struct trusted_cert));
+	pr_info("%d trusted manager certs\n", trusted_cert_count);
+
+	smp_store_release(&apk_sign_ready, true);
+out:
+	mutex_unlock(&apk_sign_init_mutex);
+	return ret;
+}
 
-#define CERT_MAX_LENGTH 1024
-		char cert[CERT_MAX_LENGTH];
-		if (*size4 > CERT_MAX_LENGTH) {
-			pr_info("cert length overlimit\n");
-			return false;
-		}
-		ksu_kernel_read_compat(fp, cert, *size4, pos);
-		unsigned char digest[SHA256_DIGEST_SIZE];
-		if (IS_ERR(ksu_sha256(cert, *size4, digest))) {
-			pr_info("sha256 error\n");
-			return false;
-		}
+static bool is_trusted_cert_size(u32 size)
+{
+	int lo = 0, hi = trusted_cert_count - 1;
 
-		char hash_str[SHA256_DIGEST_SIZE * 2 + 1];
-		hash_str[SHA256_DIGEST_SIZE * 2] = '\0';
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
 
-		bin2hex(hash_str, digest, SHA256_DIGEST_SIZE);
-		pr_info("sha256: %s, expected: %s\n", hash_str,
-			expected_sha256);
-		if (strcmp(expected_sha256, hash_str) == 0) {
+		if (trusted_certs[mid].size == size)
 			return true;
-		}
+		if (trusted_certs[mid].size < size)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
 	}
 	return false;
 }
 
-struct zip_entry_header {
-	uint32_t signature;
-	uint16_t version;
-	uint16_t flags;
-	uint16_t compression;
-	uint16_t mod_time;
-	uint16_t mod_date;
-	uint32_t crc32;
-	uint32_t compressed_size;
-	uint32_t uncompressed_size;
-	uint16_t file_name_length;
-	uint16_t extra_field_length;
-} __attribute__((packed));
-
-// This is a necessary but not sufficient condition, but it is enough for us
-static bool has_v1_signature_file(struct file *fp)
+static bool is_trusted_cert(const u8 *cert, u32 size)
 {
-	struct zip_entry_header header;
-	const char MANIFEST[] = "META-INF/MANIFEST.MF";
+	struct trusted_cert key = { .size = size };
 
-	loff_t pos = 0;
+	// don't bother hashing certs that can't match
+	if (!is_trusted_cert_size(size))
+		return false;
 
-	while (ksu_kernel_read_compat(fp, &header,
-				      sizeof(struct zip_entry_header), &pos) ==
-	       sizeof(struct zip_entry_header)) {
-		if (header.signature != 0x04034b50) {
-			// ZIP magic: 'PK'
-			return false;
-		}
-		// Read the entry file name
-		if (header.file_name_length == sizeof(MANIFEST) - 1) {
-			char fileName[sizeof(MANIFEST)];
-			ksu_kernel_read_compat(fp, fileName,
-					       header.file_name_length, &pos);
-			fileName[header.file_name_length] = '\0';
-
-			// Check if the entry matches META-INF/MANIFEST.MF
-			if (strncmp(MANIFEST, fileName, sizeof(MANIFEST) - 1) ==
-			    0) {
-				return true;
-			}
-		} else {
-			// Skip the entry file name
-			pos += header.file_name_length;
-		}
+	if (ksu_sha256(cert, size, key.digest)) {
+		pr_info("sha256 error\n");
+		return false;
+	}
+
+	pr_info("sha256: %*phN\n", SHA256_DIGEST_SIZE, key.digest);
+	return bsearch(&key, trusted_certs, trusted_cert_count,
+		       sizeof(struct trusted_cert), cmp_trusted_cert) != NULL;
+}
 
-		// Skip to the next entry
-		pos += header.extra_field_length + header.compressed_size;
+static bool check_v2_cert(const struct apk_sig_info *info)
+{
+	if (!info->v2_cert)
+		return false;
+
+#define CERT_MAX_LENGTH 1024
+	if (info->v2_cert_len > CERT_MAX_LENGTH) {
+		pr_info("cert length overlimit\n");
+		return false;
 	}
 
-	return false;
+	return is_trusted_cert(info->v2_cert, info->v2_cert_len);
 }
 
-static __always_inline bool check_v2_signature(char *path,
-					       unsigned expected_size,
-					       const char *expected_sha256)
+// This is a necessary but not sufficient condition, but it is enough for us
+static int has_v1_signature_file(struct file *fp, const struct apk_eocd *eocd)
 {
-	unsigned char buffer[0x11] = { 0 };
-	u32 size4;
-	u64 size8, size_of_block;
+	loff_t pos = eocd->cd_offset;
+	u8 *cd;
+	int ret;
 
-	loff_t pos;
+	if (eocd->cd_size > ZIP_CD_MAX_SIZE)
+		return -E2BIG;
 
-	bool v2_signing_valid = false;
-	int v2_signing_blocks = 0;
-	bool v3_signing_exist = false;
-	bool v3_1_signing_exist = false;
+	cd = vmalloc(eocd->cd_size ? eocd->cd_size : 1);
+	if (!cd)
+		return -ENOMEM;
 
-	int i;
-	struct file *fp = ksu_filp_open_compat(path, O_RDONLY, 0);
-	if (IS_ERR(fp)) {
-		pr_err("open %s error.\n", path);
-		return false;
+	if (ksu_kernel_read_compat(fp, cd, eocd->cd_size, &pos) !=
+	    eocd->cd_size) {
+		ret = -EIO;
+		goto out;
 	}
 
-	// disable inotify for this file
-	fp->f_mode |= FMODE_NONOTIFY;
+	ret = ksu_apk_find_v1_manifest(cd, eocd->cd_size, eocd->cd_entries);
+out:
+	vfree(cd);
+	return ret;
+}
+
+static __always_inline bool check_v2_signature(struct file *fp)
+{
+	struct apk_sig_info info = { 0 };
+	struct apk_eocd eocd;
+	bool v2_signing_valid = false;
+	u8 footer[APK_SIG_BLOCK_FOOTER_SIZE];
+	u8 *buf = NULL;
+	size_t len;
+	u64 size8;
+	loff_t size, pos;
 
 	// https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
-	for (i = 0;; ++i) {
-		unsigned short n;
-		pos = generic_file_llseek(fp, -i - 2, SEEK_END);
-		ksu_kernel_read_compat(fp, &n, 2, &pos);
-		if (n == i) {
-			pos -= 22;
-			ksu_kernel_read_compat(fp, &size4, 4, &pos);
-			if ((size4 ^ 0xcafebabeu) == 0xccfbf1eeu) {
-				break;
-			}
-		}
-		if (i == 0xffff) {
-			pr_info("error: cannot find eocd\n");
-			goto clean;
-		}
-	}
+	// read the whole possible tail at once and find the EOCD in memory
+	size = i_size_read(file_inode(fp));
+	len = min_t(loff_t, size, APK_MAX_COMMENT_SIZE + APK_EOCD_SIZE);
+	if (len < APK_EOCD_SIZE)
+		return false;
 
-	pos += 12;
-	// offset
-	ksu_kernel_read_compat(fp, &size4, 0x4, &pos);
-	pos = size4 - 0x18;
+	buf = vmalloc(len);
+	if (!buf)
+		return false;
 
-	ksu_kernel_read_compat(fp, &size8, 0x8, &pos);
-	ksu_kernel_read_compat(fp, buffer, 0x10, &pos);
-	if (strcmp((char *)buffer, "APK Sig Block 42")) {
+	pos = size - len;
+	if (ksu_kernel_read_compat(fp, buf, len, &pos) != len)
 		goto clean;
-	}
 
-	pos = size4 - (size8 + 0x8);
-	ksu_kernel_read_compat(fp, &size_of_block, 0x8, &pos);
-	if (size_of_block != size8) {
+	if (ksu_apk_find_eocd(buf, len, &eocd)) {
+		pr_info("error: cannot find eocd\n");
 		goto clean;
 	}
+	vfree(buf);
+	buf = NULL;
 
-	int loop_count = 0;
-	while (loop_count++ < 10) {
-		uint32_t id;
-		uint32_t offset;
-		ksu_kernel_read_compat(fp, &size8, 0x8,
-				       &pos); // sequence length
-		if (size8 == size_of_block) {
-			break;
-		}
-		ksu_kernel_read_compat(fp, &id, 0x4, &pos); // id
-		offset = 4;
-		if (id == 0x7109871au) {
-			v2_signing_blocks++;
-			v2_signing_valid =
-				check_block(fp, &size4, &pos, &offset,
-					    expected_size, expected_sha256);
-		} else if (id == 0xf05368c0u) {
-			// http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#73
-			v3_signing_exist = true;
-		} else if (id == 0x1b93ad61u) {
-			// http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#74
-			v3_1_signing_exist = true;
-		} else {
-#ifdef CONFIG_KSU_DEBUG
-			pr_info("Unknown id: 0x%08x\n", id);
-#endif
-		}
-		pos += (size8 - offset);
+	// https://source.android.com/docs/security/features/apksigning/v2#apk-signing-block
+	if (eocd.cd_offset < APK_SIG_BLOCK_FOOTER_SIZE + sizeof(u64))
+		goto clean;
+
+	pos = eocd.cd_offset - APK_SIG_BLOCK_FOOTER_SIZE;
+	if (ksu_kernel_read_compat(fp, footer, sizeof(footer), &pos) !=
+	    sizeof(footer))
+		goto clean;
+	if (memcmp(footer + sizeof(u64), APK_SIG_BLOCK_MAGIC,
+		   sizeof(footer) - sizeof(u64)))
+		goto clean;
+
+	size8 = get_unaligned_le64(footer);
+	if (size8 < APK_SIG_BLOCK_FOOTER_SIZE ||
+	    size8 > APK_SIG_BLOCK_MAX_SIZE ||
+	    size8 + sizeof(u64) > eocd.cd_offset)
+		goto clean;
+
+	// the whole block, including its leading size
+	len = size8 + sizeof(u64);
+	buf = vmalloc(len);
+	if (!buf)
+		goto clean;
+
+	pos = eocd.cd_offset - len;
+	if (ksu_kernel_read_compat(fp, buf, len, &pos) != len)
+		goto clean;
+	if (get_unaligned_le64(buf) != size8)
+		goto clean;
+
+	if (ksu_apk_parse_signing_block(buf + sizeof(u64),
+					size8 - APK_SIG_BLOCK_FOOTER_SIZE,
+					&info)) {
+		pr_info("error: malformed signing block\n");
+		goto clean;
 	}
 
-	if (v2_signing_blocks != 1) {
+	if (info.v2_signing_blocks != 1) {
 #ifdef CONFIG_KSU_DEBUG
 		pr_err("Unexpected v2 signature count: %d\n",
-		       v2_signing_blocks);
+		       info.v2_signing_blocks);
 #endif
-		v2_signing_valid = false;
+	} else {
+		v2_signing_valid = check_v2_cert(&info);
 	}
 
 	if (v2_signing_valid) {
-		int has_v1_signing = has_v1_signature_file(fp);
-		if (has_v1_signing) {
+		int has_v1_signing = has_v1_signature_file(fp, &eocd);
+		if (has_v1_signing > 0) {
 			pr_err("Unexpected v1 signature scheme found!\n");
-			filp_close(fp, 0);
-			return false;
+			v2_signing_valid = false;
+		} else if (has_v1_signing < 0) {
+			pr_err("read central directory failed: %d\n",
+			       has_v1_signing);
+			v2_signing_valid = false;
 		}
 	}
 clean:
-	filp_close(fp, 0);
+	vfree(buf);
 
-	if (v3_signing_exist || v3_1_signing_exist) {
+	if (info.v3_signing_exist || info.v3_1_signing_exist) {
 #ifdef CONFIG_KSU_DEBUG
 		pr_err("Unexpected v3 signature scheme found!\n");
 #endif
@@ -314,7 +361,296 @@ module_param_cb(ksu_debug_manager_uid, &expected_size_ops,
 
 #endif
 
+#define KERNEL_SU_APK_CACHE "/data/adb/ksu/.apk_cache"
+#define APK_CACHE_MAGIC 0x7f4b5343 // ' KSC', u32
+#define APK_CACHE_VERSION 1 // u32
+#define APK_CACHE_MAX_ENTRIES 1024
+#define APK_CACHE_BITS 8
+
+// Verification results are keyed by file identity rather than path: an APK
+// replaced in place changes ino/size/ctime and gets verified again.
+struct apk_identity {
+	u64 ino;
+	s64 size;
+	s64 mtime_sec;
+	s64 ctime_sec;
+	u32 mtime_nsec;
+	u32 ctime_nsec;
+	u32 dev;
+	u32 trusted;
+};
+
+struct apk_cache_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	struct apk_identity id;
+};
+
+struct apk_cache_header {
+	u32 magic;
+	u32 version;
+	u32 trust_id;
+	u32 count;
+};
+
+static DEFINE_HASHTABLE(apk_cache, APK_CACHE_BITS);
+static LIST_HEAD(apk_cache_lru);
+static DEFINE_MUTEX(apk_cache_mutex);
+static int apk_cache_count;
+static bool apk_cache_loaded;
+static bool apk_cache_dirty;
+
+// results are only valid for the certificates they were checked against
+static u32 apk_cache_trust_id(void)
+{
+	return trusted_certs_id;
+}
+
+static inline u32 apk_identity_key(const struct apk_identity *id)
+{
+	return (u32)id->ino ^ id->dev;
+}
+
+static inline bool apk_identity_equal(const struct apk_identity *a,
+				      const struct apk_identity *b)
+{
+	return a->ino == b->ino && a->dev == b->dev && a->size == b->size &&
+	       a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+	       a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+static int get_apk_identity(struct file *fp, struct apk_identity *id)
+{
+	struct kstat stat;
+	int ret = ksu_vfs_getattr_compat(fp, &stat);
+
+	if (ret)
+		return ret;
+
+	memset(id, 0, sizeof(*id));
+	id->ino = stat.ino;
+	id->dev = (u32)stat.dev;
+	id->size = stat.size;
+	id->mtime_sec = stat.mtime.tv_sec;
+	id->mtime_nsec = stat.mtime.tv_nsec;
+	id->ctime_sec = stat.ctime.tv_sec;
+	id->ctime_nsec = stat.ctime.tv_nsec;
+	return 0;
+}
+
+static struct apk_cache_entry *apk_cache_find(const struct apk_identity *id)
+{
+	struct apk_cache_entry *entry;
+
+	hash_for_each_possible (apk_cache, entry, node, apk_identity_key(id)) {
+		if (entry->id.ino == id->ino && entry->id.dev == id->dev)
+			return entry;
+	}
+	return NULL;
+}
+
+static void apk_cache_insert(const struct apk_identity *id)
+{
+	struct apk_cache_entry *entry = apk_cache_find(id);
+
+	if (entry) {
+		// same inode but changed content, refresh it
+		entry->id = *id;
+		list_move(&entry->lru, &apk_cache_lru);
+		return;
+	}
+
+	if (apk_cache_count >= APK_CACHE_MAX_ENTRIES) {
+		entry = list_last_entry(&apk_cache_lru, struct apk_cache_entry,
+					lru);
+		hash_del(&entry->node);
+		list_del(&entry->lru);
+		apk_cache_count--;
+	} else {
+		entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry)
+			return;
+	}
+
+	entry->id = *id;
+	hash_add(apk_cache, &entry->node, apk_identity_key(id));
+	list_add(&entry->lru, &apk_cache_lru);
+	apk_cache_count++;
+}
+
+static void apk_cache_load_locked(void)
+{
+	struct apk_cache_header header;
+	struct apk_identity id;
+	struct file *fp;
+	loff_t off = 0;
+	u32 i;
+
+	apk_cache_loaded = true;
+
+	fp = ksu_filp_open_compat(KERNEL_SU_APK_CACHE, O_RDONLY, 0);
+	if (IS_ERR(fp)) {
+		pr_info("apk_cache: no cache file: %ld\n", PTR_ERR(fp));
+		return;
+	}
+
+	if (ksu_kernel_read_compat(fp, &header, sizeof(header), &off) !=
+		    sizeof(header) ||
+	    header.magic != APK_CACHE_MAGIC ||
+	    header.version != APK_CACHE_VERSION ||
+	    header.trust_id != apk_cache_trust_id()) {
+		pr_info("apk_cache: stale or invalid cache file, ignore it\n");
+		goto exit;
+	}
+
+	for (i = 0; i < header.count && i < APK_CACHE_MAX_ENTRIES; i++) {
+		if (ksu_kernel_read_compat(fp, &id, sizeof(id), &off) !=
+		    sizeof(id))
+			break;
+		apk_cache_insert(&id);
+	}
+	pr_info("apk_cache: loaded %d entries\n", apk_cache_count);
+
+exit:
+	filp_close(fp, 0);
+}
+
+static void do_save_apk_cache(struct work_struct *work)
+{
+	struct apk_cache_header *header;
+	struct apk_identity *ids;
+	struct apk_cache_entry *entry;
+	struct file *fp;
+	size_t len;
+	loff_t off = 0;
+	u32 n = 0;
+
+	// snapshot under the mutex and write without it, verifiers running in
+	// parallel must not wait for the file I/O
+	header = vmalloc(sizeof(*header) +
+			 APK_CACHE_MAX_ENTRIES * sizeof(struct apk_identity));
+	if (!header) {
+		pr_err("apk_cache: alloc snapshot failed\n");
+		return;
+	}
+	ids = (struct apk_identity *)(header + 1);
+
+	mutex_lock(&apk_cache_mutex);
+	if (!apk_cache_dirty) {
+		mutex_unlock(&apk_cache_mutex);
+		goto out;
+	}
+	list_for_each_entry (entry, &apk_cache_lru, lru) {
+		if (n >= APK_CACHE_MAX_ENTRIES)
+			break;
+		ids[n++] = entry->id;
+	}
+	apk_cache_dirty = false;
+	mutex_unlock(&apk_cache_mutex);
+
+	header->magic = APK_CACHE_MAGIC;
+	header->version = APK_CACHE_VERSION;
+	header->trust_id = apk_cache_trust_id();
+	header->count = n;
+	len = sizeof(*header) + n * sizeof(*ids);
+
+	fp = ksu_filp_open_compat(KERNEL_SU_APK_CACHE,
+				  O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (IS_ERR(fp)) {
+		pr_err("apk_cache: create file failed: %ld\n", PTR_ERR(fp));
+		goto failed;
+	}
+	if (ksu_kernel_write_compat(fp, header, len, &off) != (ssize_t)len) {
+		pr_err("apk_cache: write failed\n");
+		filp_close(fp, 0);
+		goto failed;
+	}
+	filp_close(fp, 0);
+	goto out;
+
+failed:
+	// try again on the next save
+	mutex_lock(&apk_cache_mutex);
+	apk_cache_dirty = true;
+	mutex_unlock(&apk_cache_mutex);
+out:
+	vfree(header);
+}
+
+static DECLARE_WORK(apk_cache_save_work, do_save_apk_cache);
+
 bool is_manager_apk(char *path)
 {
-	return check_v2_signature(path, EXPECTED_SIZE, EXPECTED_HASH);
-}
\ No newline at end of file
+	struct apk_cache_entry *entry;
+	struct apk_identity id;
+	bool has_identity;
+	bool trusted;
+
+	if (apk_sign_prepare())
+		return false;
+
+	struct file *fp = ksu_filp_open_compat(path, O_RDONLY, 0);
+	if (IS_ERR(fp)) {
+		pr_err("open %s error.\n", path);
+		return false;
+	}
+
+	// disable inotify for this file
+	fp->f_mode |= FMODE_NONOTIFY;
+
+	has_identity = !get_apk_identity(fp, &id);
+	if (has_identity) {
+		mutex_lock(&apk_cache_mutex);
+		if (!apk_cache_loaded)
+			apk_cache_load_locked();
+		entry = apk_cache_find(&id);
+		if (entry && apk_identity_equal(&entry->id, &id)) {
+			trusted = entry->id.trusted;
+			list_move(&entry->lru, &apk_cache_lru);
+			mutex_unlock(&apk_cache_mutex);
+			goto out;
+		}
+		mutex_unlock(&apk_cache_mutex);
+	}
+
+	trusted = check_v2_signature(fp);
+	pr_info("verified %s, is_manager: %d\n", path, trusted);
+
+	if (has_identity) {
+		id.trusted = trusted;
+		mutex_lock(&apk_cache_mutex);
+		apk_cache_insert(&id);
+		apk_cache_dirty = true;
+		mutex_unlock(&apk_cache_mutex);
+		ksu_queue_work(&apk_cache_save_work);
+	}
+out:
+	filp_close(fp, 0);
+	return trusted;
+}
+
+void ksu_apk_sign_exit(void)
+{
+	struct apk_cache_entry *entry, *n;
+
+	cancel_work_sync(&apk_cache_save_work);
+	do_save_apk_cache(NULL);
+
+	mutex_lock(&apk_cache_mutex);
+	list_for_each_entry_safe (entry, n, &apk_cache_lru, lru) {
+		hash_del(&entry->node);
+		list_del(&entry->lru);
+		kfree(entry);
+	}
+	apk_cache_count = 0;
+	apk_cache_loaded = false;
+	mutex_unlock(&apk_cache_mutex);
+
+	mutex_lock(&apk_sign_init_mutex);
+	if (sha256_tfm) {
+		crypto_free_shash(sha256_tfm);
+		sha256_tfm = NULL;
+	}
+	apk_sign_ready = false;
+	mutex_unlock(&apk_sign_init_mutex);
+}
@@ -5,4 +5,6 @@
 
 bool is_manager_apk(char *path);
 
+void ksu_apk_sign_exit(void);
+
 #endif
@@ -43,10 +43,15 @@
 #include "throne_tracker.h"
 #include "throne_tracker.h"
 #include "kernel_compat.h"
+#include "timeline.h"
 
 static bool ksu_module_mounted = false;
 
+#define BECOME_MANAGER_WAIT_TIMEOUT msecs_to_jiffies(2000)
+
 extern int handle_sepolicy(unsigned long arg3, void __user *arg4);
+extern int handle_sepolicy_batch(void __user *arg);
+extern int handle_sepolicy_dump(char __user *buf, u32 __user *size);
 
 static inline bool is_allow_su()
 {
@@ -199,11 +204,37 @@ int ksu_handle_rename(struct dentry *old_dentry, struct dentry *new_dentry)
 	pr_info("renameat: %s -> %s, new path: %s\n", old_dentry->d_iname,
 		new_dentry->d_iname, buf);
 
-	track_throne();
+	ksu_queue_track_throne();
 
 	return 0;
 }
 
+// arg3 of CMD_BECOME_MANAGER is the caller's data dir:
+// /data/data/<pkg> or /data/user/<userid>/<pkg>
+static void try_become_manager(const char __user *data_dir)
+{
+	char path[KSU_MAX_PACKAGE_NAME + 32];
+	char *package;
+	long len;
+
+	if (!data_dir)
+		return;
+
+	len = ksu_strncpy_from_user_nofault(path, data_dir, sizeof(path));
+	if (len <= 0 || len >= sizeof(path))
+		return;
+
+	if (startswith(path, "/data/data/") && startswith(path, "/data/user/"))
+		return;
+
+	package = strrchr(path, '/');
+	if (!package || !*++package)
+		return;
+
+	if (ksu_verify_manager_package(package, current_uid().val))
+		pr_info("become_manager: %s verified on demand\n", package);
+}
+
 int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 		     unsigned long arg4, unsigned long arg5)
 {
@@ -215,6 +246,16 @@ int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 		return 0;
 	}
 
+	if (arg2 == CMD_BECOME_MANAGER && !is_manager()) {
+		// a freshly installed manager may race with the pending
+		// packages.list scan, give it a chance to be crowned first
+		if (!ksu_wait_track_throne(current_uid().val,
+					   BECOME_MANAGER_WAIT_TIMEOUT))
+			pr_info("become_manager: throne tracker is still busy\n");
+		else if (!ksu_is_manager_uid_valid())
+			try_become_manager((const char __user *)arg3);
+	}
+
 	// TODO: find it in throne tracker!
 	uid_t current_uid_val = current_uid().val;
 	uid_t manager_uid = ksu_get_manager_uid();
@@ -231,6 +272,9 @@ int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 		return 0;
 	}
 
+	// catch up with a policy load the avc callback could not report
+	ksu_sepolicy_check_reload();
+
 #ifdef CONFIG_KSU_DEBUG
 	pr_info("option: 0x%x, cmd: %ld\n", option, arg2);
 #endif
@@ -284,6 +328,8 @@ int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 				post_fs_data_lock = true;
 				pr_info("post-fs-data triggered\n");
 				on_post_fs_data();
+				// keep a timeline even if the boot never completes
+				ksu_timeline_save();
 			}
 			break;
 		}
@@ -292,12 +338,16 @@ int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 			if (!boot_complete_lock) {
 				boot_complete_lock = true;
 				pr_info("boot_complete triggered\n");
+				ksu_timeline_record(KSU_BOOT_COMPLETED);
+				ksu_timeline_save();
 			}
 			break;
 		}
 		case EVENT_MODULE_MOUNTED: {
 			ksu_module_mounted = true;
 			pr_info("module mounted!\n");
+			ksu_timeline_record(KSU_BOOT_MODULE_MOUNTED);
+			ksu_timeline_save();
 			break;
 		}
 		default:
@@ -319,6 +369,33 @@ int ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 		return 0;
 	}
 
+	if (arg2 == CMD_SET_SEPOLICY_BATCH) {
+		if (!from_root) {
+			return 0;
+		}
+		if (!handle_sepolicy_batch((void __user *)arg3)) {
+			if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+				pr_err("sepolicy_batch: prctl reply error\n");
+			}
+		}
+
+		return 0;
+	}
+
+	if (arg2 == CMD_GET_SEPOLICY_DUMP) {
+		if (!from_root) {
+			return 0;
+		}
+		if (!handle_sepolicy_dump((char __user *)arg3,
+					  (u32 __user *)arg4)) {
+			if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+				pr_err("sepolicy_dump: prctl reply error\n");
+			}
+		}
+
+		return 0;
+	}
+
 	if (arg2 == CMD_CHECK_SAFEMODE) {
 		if (ksu_is_safe_mode()) {
 			pr_warn("safemode enabled!\n");
@@ -0,0 +1,215 @@
+#include "file_parser.h"
+
+// packages.list lines look like "<package> <uid> <debuggable> <data dir> ...".
+// The line is split in place, on success *package points into it.
+int ksu_parse_packages_line(char *line, char **package, u32 *uid)
+{
+	char *tmp = line;
+	char *name = strsep(&tmp, " ");
+	char *uid_str = strsep(&tmp, " ");
+
+	if (!name || !*name || !uid_str)
+		return -EINVAL;
+	if (strlen(name) >= KSU_MAX_PACKAGE_NAME)
+		return -ENAMETOOLONG;
+	if (kstrtou32(uid_str, 10, uid))
+		return -EINVAL;
+
+	*package = name;
+	return 0;
+}
+
+// bounds checked cursor over an in-memory buffer
+struct apk_reader {
+	const u8 *data;
+	size_t len;
+	size_t pos;
+};
+
+static bool apk_read_u32(struct apk_reader *r, u32 *val)
+{
+	if (r->len - r->pos < sizeof(u32))
+		return false;
+	*val = get_unaligned_le32(r->data + r->pos);
+	r->pos += sizeof(u32);
+	return true;
+}
+
+static bool apk_read_u64(struct apk_reader *r, u64 *val)
+{
+	if (r->len - r->pos < sizeof(u64))
+		return false;
+	*val = get_unaligned_le64(r->data + r->pos);
+	r->pos += sizeof(u64);
+	return true;
+}
+
+// take a u32 length-prefixed slice and advance past it
+static bool apk_read_slice(struct apk_reader *r, struct apk_reader *slice)
+{
+	u32 len;
+
+	if (!apk_read_u32(r, &len) || len > r->len - r->pos)
+		return false;
+	slice->data = r->data + r->pos;
+	slice->len = len;
+	slice->pos = 0;
+	r->pos += len;
+	return true;
+}
+
+// The EOCD is the last record of the archive, followed only by its comment.
+int ksu_apk_find_eocd(const u8 *tail, size_t len, struct apk_eocd *eocd)
+{
+	size_t comment_len, max_comment_len;
+
+	if (len < APK_EOCD_SIZE)
+		return -EINVAL;
+
+	max_comment_len = min_t(size_t, len - APK_EOCD_SIZE,
+				APK_MAX_COMMENT_SIZE);
+	for (comment_len = 0; comment_len <= max_comment_len; comment_len++) {
+		const u8 *p = tail + len - APK_EOCD_SIZE - comment_len;
+
+		if (get_unaligned_le16(p + 20) != comment_len ||
+		    get_unaligned_le32(p) != APK_EOCD_MAGIC)
+			continue;
+
+		eocd->cd_entries = get_unaligned_le16(p + 10);
+		eocd->cd_size = get_unaligned_le32(p + 12);
+		eocd->cd_offset = get_unaligned_le32(p + 16);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+// https://source.android.com/docs/security/features/apksigning/v2#apk-signature-scheme-v2-block-format
+static bool parse_v2_block(const u8 *data, size_t len,
+			   struct apk_sig_info *info)
+{
+	struct apk_reader block = { .data = data, .len = len };
+	struct apk_reader signers, signer, signed_data, digests, certs, cert;
+
+	if (!apk_read_slice(&block, &signers) || // signer-sequence
+	    !apk_read_slice(&signers, &signer) || // first signer
+	    !apk_read_slice(&signer, &signed_data) ||
+	    !apk_read_slice(&signed_data, &digests) ||
+	    !apk_read_slice(&signed_data, &certs) ||
+	    !apk_read_slice(&certs, &cert)) // first certificate
+		return false;
+
+	info->v2_cert = cert.data;
+	info->v2_cert_len = cert.len;
+	return true;
+}
+
+// walk the id-value pairs of the APK Signing Block
+int ksu_apk_parse_signing_block(const u8 *pairs, size_t len,
+				struct apk_sig_info *info)
+{
+	struct apk_reader r = { .data = pairs, .len = len };
+	int count = 0;
+
+	while (r.pos < r.len) {
+		u64 pair_len;
+		u32 id;
+
+		if (++count > APK_SIG_BLOCK_MAX_PAIRS)
+			return -E2BIG;
+		if (!apk_read_u64(&r, &pair_len) || pair_len < sizeof(u32) ||
+		    pair_len > r.len - r.pos)
+			return -EINVAL;
+
+		id = get_unaligned_le32(r.data + r.pos);
+		if (id == 0x7109871au) {
+			info->v2_signing_blocks++;
+			info->v2_cert = NULL;
+			info->v2_cert_len = 0;
+			parse_v2_block(r.data + r.pos + sizeof(u32),
+				       pair_len - sizeof(u32), info);
+		} else if (id == 0xf05368c0u) {
+			// http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#73
+			info->v3_signing_exist = true;
+		} else if (id == 0x1b93ad61u) {
+			// http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#74
+			info->v3_1_signing_exist = true;
+		}
+		r.pos += pair_len;
+	}
+
+	return 0;
+}
+
+// Search the central directory for META-INF/MANIFEST.MF. Its records are
+// contiguous, so one read covers every entry no matter how large the
+// archive is, and data descriptors don't matter.
+int ksu_apk_find_v1_manifest(const u8 *cd, size_t len, u16 entries)
+{
+	static const char MANIFEST[] = "META-INF/MANIFEST.MF";
+	size_t pos = 0;
+	u32 i;
+
+	for (i = 0; i < entries; i++) {
+		u16 name_len, extra_len, comment_len;
+		const u8 *p = cd + pos;
+
+		if (len - pos < ZIP_CD_HEADER_SIZE ||
+		    get_unaligned_le32(p) != ZIP_CD_MAGIC)
+			return -EINVAL;
+
+		name_len = get_unaligned_le16(p + 28);
+		extra_len = get_unaligned_le16(p + 30);
+		comment_len = get_unaligned_le16(p + 32);
+		if (len - pos - ZIP_CD_HEADER_SIZE <
+		    (size_t)name_len + extra_len + comment_len)
+			return -EINVAL;
+
+		if (name_len == sizeof(MANIFEST) - 1 &&
+		    !memcmp(p + ZIP_CD_HEADER_SIZE, MANIFEST, name_len))
+			return 1;
+
+		pos += ZIP_CD_HEADER_SIZE + name_len + extra_len + comment_len;
+	}
+
+	return 0;
+}
+
+int ksu_parse_allowlist_header(const void *buf, size_t len, u32 *version)
+{
+	const struct ksu_allowlist_header *header = buf;
+
+	if (len < sizeof(*header) || header->magic != KSU_ALLOWLIST_MAGIC)
+		return -EINVAL;
+
+	*version = header->version;
+	return 0;
+}
+
+static inline bool is_terminated(const char *str, size_t size)
+{
+	return memchr(str, '\0', size) != NULL;
+}
+
+// copy one allowlist record, rejecting strings without a terminator
+int ksu_parse_app_profile(const void *buf, size_t len,
+			  struct app_profile *profile)
+{
+	if (len != sizeof(*profile))
+		return -EINVAL;
+
+	memcpy(profile, buf, sizeof(*profile));
+	if (!is_terminated(profile->key, sizeof(profile->key)))
+		return -EINVAL;
+
+	if (profile->allow_su) {
+		if (!is_terminated(profile->rp_config.template_name,
+				   sizeof(profile->rp_config.template_name)) ||
+		    !is_terminated(
+			    profile->rp_config.profile.selinux_domain,
+			    sizeof(profile->rp_config.profile.selinux_domain)))
+			return -EINVAL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef __KSU_H_FILE_PARSER
+#define __KSU_H_FILE_PARSER
+
+/*
+ * Parsers for the files KernelSU reads: packages.list, APK signing data
+ * and the allowlist. They only work on memory buffers, so the same source
+ * builds in the kernel and, through host/shim.h, as a userspace library.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#else
+#include "host/shim.h"
+#endif
+
+#include "ksu.h"
+
+// packages.list
+
+int ksu_parse_packages_line(char *line, char **package, u32 *uid);
+
+// APK
+
+#define APK_EOCD_MAGIC 0x06054b50
+#define APK_EOCD_SIZE 22
+#define APK_MAX_COMMENT_SIZE 0xffff
+#define APK_SIG_BLOCK_MAGIC "APK Sig Block 42"
+#define APK_SIG_BLOCK_FOOTER_SIZE 24 // size of block + magic
+#define APK_SIG_BLOCK_MAX_SIZE (1 << 20)
+#define APK_SIG_BLOCK_MAX_PAIRS 64
+
+#define ZIP_CD_MAGIC 0x02014b50
+#define ZIP_CD_HEADER_SIZE 46
+#define ZIP_CD_MAX_SIZE (8 << 20)
+
+struct apk_eocd {
+	u32 cd_offset;
+	u32 cd_size;
+	u16 cd_entries;
+};
+
+struct apk_sig_info {
+	int v2_signing_blocks;
+	bool v3_signing_exist;
+	bool v3_1_signing_exist;
+	// first certificate of the first signer of the last v2 block
+	const u8 *v2_cert;
+	u32 v2_cert_len;
+};
+
+int ksu_apk_find_eocd(const u8 *tail, size_t len, struct apk_eocd *eocd);
+
+int ksu_apk_parse_signing_block(const u8 *pairs, size_t len,
+				struct apk_sig_info *info);
+
+int ksu_apk_find_v1_manifest(const u8 *cd, size_t len, u16 entries);
+
+// allowlist
+
+#define KSU_ALLOWLIST_MAGIC 0x7f4b5355 // ' KSU', u32
+#define KSU_ALLOWLIST_VERSION 3 // u32
+
+struct ksu_allowlist_header {
+	u32 magic;
+	u32 version;
+};
+
+int ksu_parse_allowlist_header(const void *buf, size_t len, u32 *version);
+
+int ksu_parse_app_profile(const void *buf, size_t len,
+			  struct app_profile *profile);
+
+#endif
@@ -0,0 +1,131 @@
+// Runs a fuzz target over the files of a corpus and reports its throughput:
+//
+//   ./bench_apk [-n iterations] corpus/apk
+//
+// Linked against any fuzz_*.c instead of libFuzzer, so it also replays a
+// crash file outside of the fuzzer.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "fuzz.h"
+
+struct input {
+	uint8_t *data;
+	size_t size;
+};
+
+static struct input *inputs;
+static size_t input_count;
+
+static int load_file(const char *path)
+{
+	struct input *in;
+	FILE *fp = fopen(path, "rb");
+	long size;
+
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	inputs = realloc(inputs, (input_count + 1) * sizeof(*inputs));
+	if (!inputs)
+		abort();
+	in = &inputs[input_count++];
+	in->size = size;
+	// at least one byte, so that empty files are valid inputs as well
+	in->data = malloc(size ? size : 1);
+	if (!in->data || fread(in->data, 1, size, fp) != (size_t)size) {
+		fprintf(stderr, "%s: read failed\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int load(const char *path)
+{
+	char child[4096];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+
+	if (stat(path, &st)) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return load_file(path);
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+	while (!ret && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+		ret = load(child);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = 1000, i;
+	size_t total = 0, j;
+	double start, elapsed;
+	int arg = 1;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		iterations = strtoul(argv[2], NULL, 10);
+		arg = 3;
+	}
+	if (arg == argc || !iterations) {
+		fprintf(stderr, "usage: %s [-n iterations] <file|dir>...\n",
+			argv[0]);
+		return 2;
+	}
+
+	for (; arg < argc; arg++)
+		if (load(argv[arg]))
+			return 1;
+	if (!input_count) {
+		fprintf(stderr, "no inputs\n");
+		return 1;
+	}
+	for (j = 0; j < input_count; j++)
+		total += inputs[j].size;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		for (j = 0; j < input_count; j++)
+			LLVMFuzzerTestOneInput(inputs[j].data, inputs[j].size);
+	elapsed = now() - start;
+
+	printf("%zu inputs, %zu bytes, %lu iterations: %.0f ns/input, %.1f MB/s\n",
+	       input_count, total, iterations,
+	       elapsed * 1e9 / ((double)iterations * input_count),
+	       (double)total * iterations / elapsed / 1e6);
+	return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef __KSU_H_HOST_FUZZ
+#define __KSU_H_HOST_FUZZ
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Entry point of every fuzz_*.c target. libFuzzer calls it with mutated
+// inputs, bench.c with the files of a corpus.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,29 @@
+// libFuzzer target: a whole allowlist file, read like do_load_allow_list()
+// in allowlist.c: the header, then one record at a time with a short read
+// at the end.
+
+#include "../file_parser.h"
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct app_profile record, profile;
+	size_t pos = sizeof(struct ksu_allowlist_header);
+	u32 version;
+
+	if (size < pos || ksu_parse_allowlist_header(data, pos, &version))
+		return 0;
+
+	while (pos < size) {
+		size_t len = min_t(size_t, size - pos, sizeof(record));
+
+		memcpy(&record, data + pos, len);
+		pos += len;
+		if (ksu_parse_app_profile(&record, len, &profile))
+			continue;
+		if (!memchr(profile.key, '\0', sizeof(profile.key)))
+			abort();
+	}
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+// libFuzzer target: a whole APK, walked like check_v2_signature() in
+// apk_sign.c does it: EOCD in the tail, the signing block right before the
+// central directory, then the central directory itself.
+
+#include "../file_parser.h"
+#include "fuzz.h"
+
+static void walk_signing_block(const u8 *data, size_t size,
+			       const struct apk_eocd *eocd)
+{
+	struct apk_sig_info info = { 0 };
+	const u8 *footer, *block;
+	u64 size8;
+
+	if (eocd->cd_offset > size ||
+	    eocd->cd_offset < APK_SIG_BLOCK_FOOTER_SIZE + sizeof(u64))
+		return;
+
+	footer = data + eocd->cd_offset - APK_SIG_BLOCK_FOOTER_SIZE;
+	if (memcmp(footer + sizeof(u64), APK_SIG_BLOCK_MAGIC,
+		   APK_SIG_BLOCK_FOOTER_SIZE - sizeof(u64)))
+		return;
+
+	size8 = get_unaligned_le64(footer);
+	if (size8 < APK_SIG_BLOCK_FOOTER_SIZE ||
+	    size8 > APK_SIG_BLOCK_MAX_SIZE ||
+	    size8 + sizeof(u64) > eocd->cd_offset)
+		return;
+
+	block = data + eocd->cd_offset - size8 - sizeof(u64);
+	if (get_unaligned_le64(block) != size8)
+		return;
+
+	if (ksu_apk_parse_signing_block(block + sizeof(u64),
+					size8 - APK_SIG_BLOCK_FOOTER_SIZE,
+					&info))
+		return;
+
+	// the certificate must lie inside the block it was parsed from
+	if (info.v2_cert &&
+	    (info.v2_cert < block ||
+	     info.v2_cert + info.v2_cert_len > block + size8 + sizeof(u64)))
+		abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	size_t len = min_t(size_t, size, APK_MAX_COMMENT_SIZE + APK_EOCD_SIZE);
+	struct apk_eocd eocd;
+
+	if (ksu_apk_find_eocd(data + size - len, len, &eocd))
+		return 0;
+
+	walk_signing_block(data, size, &eocd);
+
+	if (eocd.cd_size <= ZIP_CD_MAX_SIZE && eocd.cd_offset <= size &&
+	    eocd.cd_size <= size - eocd.cd_offset)
+		ksu_apk_find_v1_manifest(data + eocd.cd_offset, eocd.cd_size,
+					 eocd.cd_entries);
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+// libFuzzer target: a whole packages.list, split into lines the way
+// read_packages_list() in throne_tracker.c feeds them to the parser.
+
+#include "../file_parser.h"
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *buf = malloc(size + 1);
+	char *line, *next;
+	char *package;
+	u32 uid;
+
+	if (!buf)
+		return 0;
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (!ksu_parse_packages_line(line, &package, &uid) &&
+		    strlen(package) >= KSU_MAX_PACKAGE_NAME)
+			abort();
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,267 @@
+// Writes synthetic seed/benchmark corpora for the fuzz targets:
+//
+//   ./gen_corpus corpus
+//
+// corpus/packages_list, corpus/apk and corpus/allowlist each get a few
+// well-formed files of different sizes, shaped like the real ones.
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "../file_parser.h"
+
+struct buf {
+	u8 *data;
+	size_t len;
+};
+
+static void put(struct buf *b, const void *data, size_t len)
+{
+	b->data = realloc(b->data, b->len + len);
+	if (!b->data)
+		abort();
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put_le(struct buf *b, u64 val, int bytes)
+{
+	u8 le[8];
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		le[i] = val >> (8 * i);
+	put(b, le, bytes);
+}
+
+// filler that doesn't look like any of the magics
+static void put_fill(struct buf *b, u8 seed, size_t len)
+{
+	size_t i;
+
+	b->data = realloc(b->data, b->len + len);
+	if (!b->data)
+		abort();
+	for (i = 0; i < len; i++)
+		b->data[b->len + i] = seed + i * 31;
+	b->len += len;
+}
+
+// u32 length-prefixed, consumes `inner`
+static void put_slice(struct buf *b, struct buf *inner)
+{
+	put_le(b, inner->len, 4);
+	put(b, inner->data, inner->len);
+	free(inner->data);
+	*inner = (struct buf){ 0 };
+}
+
+static void put_pair(struct buf *b, u32 id, struct buf *value)
+{
+	put_le(b, value->len + sizeof(u32), 8);
+	put_le(b, id, 4);
+	put(b, value->data, value->len);
+	free(value->data);
+	*value = (struct buf){ 0 };
+}
+
+static void write_file(const char *dir, const char *name, struct buf *b)
+{
+	char path[4096];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "wb");
+	if (!fp || fwrite(b->data, 1, b->len, fp) != b->len) {
+		perror(path);
+		exit(1);
+	}
+	fclose(fp);
+	free(b->data);
+	*b = (struct buf){ 0 };
+}
+
+static void gen_packages_list(const char *dir, const char *name, int count)
+{
+	struct buf b = { 0 };
+	char line[512];
+	int i, len;
+
+	for (i = 0; i < count; i++) {
+		len = snprintf(line, sizeof(line),
+			       "com.example.app%d %d 0 /data/user/0/com.example.app%d default:targetSdkVersion=34 3002,3003 0 %d\n",
+			       i, 10000 + i, i, 1700000000 + i);
+		put(&b, line, len);
+	}
+	write_file(dir, name, &b);
+}
+
+static void gen_malformed_packages_list(const char *dir)
+{
+	static const char lines[] = "com.example.ok 10001 0 /data/data/x\n"
+				    "com.example.nouid\n"
+				    "com.example.neg -1 0 /data\n"
+				    "com.example.big 4294967296 0 /data\n"
+				    " 10002 0 /data\n"
+				    "\n"
+				    "com.example.last 10003";
+	struct buf b = { 0 };
+
+	put(&b, lines, sizeof(lines) - 1);
+	write_file(dir, "malformed", &b);
+}
+
+struct apk_shape {
+	const char *name;
+	int entries;
+	size_t cert_len;
+	size_t comment_len;
+	bool v1_manifest;
+	bool v3;
+};
+
+static void gen_apk(const char *dir, const struct apk_shape *shape)
+{
+	struct buf apk = { 0 }, pairs = { 0 }, cd = { 0 };
+	struct buf cert = { 0 }, certs = { 0 }, digests = { 0 };
+	struct buf signed_data = { 0 }, signer = { 0 }, signers = { 0 };
+	struct buf v2 = { 0 }, value = { 0 };
+	char name[64];
+	size_t cd_offset;
+	int i;
+
+	// stand-in for the local file entries
+	put_fill(&apk, 1, 4096 + shape->entries * 64);
+
+	put_fill(&cert, 2, shape->cert_len);
+	put_slice(&certs, &cert);
+	put_le(&digests, 0, 4);
+	put_slice(&signed_data, &digests);
+	put_slice(&signed_data, &certs);
+	put_le(&signed_data, 0, 4); // additional attributes
+	put_slice(&signer, &signed_data);
+	put_le(&signer, 0, 4); // signatures
+	put_le(&signer, 0, 4); // public key
+	put_slice(&signers, &signer);
+	put_slice(&v2, &signers);
+	put_pair(&pairs, 0x7109871au, &v2);
+	if (shape->v3) {
+		put_fill(&value, 3, 1024);
+		put_pair(&pairs, 0xf05368c0u, &value);
+		put_fill(&value, 4, 1024);
+		put_pair(&pairs, 0x1b93ad61u, &value);
+	}
+	put_fill(&value, 0, 512); // verity padding
+	put_pair(&pairs, 0x42726577u, &value);
+
+	put_le(&apk, pairs.len + APK_SIG_BLOCK_FOOTER_SIZE, 8);
+	put(&apk, pairs.data, pairs.len);
+	put_le(&apk, pairs.len + APK_SIG_BLOCK_FOOTER_SIZE, 8);
+	put(&apk, APK_SIG_BLOCK_MAGIC, strlen(APK_SIG_BLOCK_MAGIC));
+	free(pairs.data);
+
+	cd_offset = apk.len;
+	for (i = 0; i < shape->entries; i++) {
+		int len;
+
+		if (shape->v1_manifest && i == shape->entries - 1)
+			len = snprintf(name, sizeof(name),
+				       "META-INF/MANIFEST.MF");
+		else
+			len = snprintf(name, sizeof(name),
+				       "res/drawable/icon_%d.png", i);
+		put_le(&cd, ZIP_CD_MAGIC, 4);
+		put_fill(&cd, 5, 24);
+		put_le(&cd, len, 2);
+		put_le(&cd, 0, 2); // extra
+		put_le(&cd, 0, 2); // comment
+		put_fill(&cd, 6, ZIP_CD_HEADER_SIZE - 34);
+		put(&cd, name, len);
+	}
+	put(&apk, cd.data, cd.len);
+
+	put_le(&apk, APK_EOCD_MAGIC, 4);
+	put_le(&apk, 0, 4); // disk numbers
+	put_le(&apk, shape->entries, 2);
+	put_le(&apk, shape->entries, 2);
+	put_le(&apk, cd.len, 4);
+	put_le(&apk, cd_offset, 4);
+	put_le(&apk, shape->comment_len, 2);
+	put_fill(&apk, 7, shape->comment_len);
+	free(cd.data);
+
+	write_file(dir, shape->name, &apk);
+}
+
+static void gen_allowlist(const char *dir, const char *name, int count)
+{
+	struct ksu_allowlist_header header = {
+		.magic = KSU_ALLOWLIST_MAGIC,
+		.version = KSU_ALLOWLIST_VERSION,
+	};
+	struct buf b = { 0 };
+	int i;
+
+	put(&b, &header, sizeof(header));
+	for (i = 0; i < count; i++) {
+		struct app_profile profile = {
+			.version = KSU_APP_PROFILE_VER,
+			.current_uid = 10000 + i,
+			.allow_su = i % 2,
+		};
+
+		snprintf(profile.key, sizeof(profile.key), "com.example.app%d",
+			 i);
+		if (profile.allow_su) {
+			profile.rp_config.use_default = true;
+			strcpy(profile.rp_config.profile.selinux_domain, "u:r:su:s0");
+		} else {
+			profile.nrp_config.profile.umount_modules = true;
+		}
+		put(&b, &profile, sizeof(profile));
+	}
+	write_file(dir, name, &b);
+}
+
+static const char *subdir(const char *root, const char *name)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	mkdir(path, 0755);
+	return path;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct apk_shape apks[] = {
+		{ "small", 10, 1024, 0, false, false },
+		{ "large", 3000, 1400, 0, false, true },
+		{ "comment", 10, 1024, 4000, false, false },
+		{ "v1", 50, 1024, 0, true, false },
+		{ "v3", 200, 1024, 0, false, true },
+	};
+	const char *dir;
+	size_t i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <dir>\n", argv[0]);
+		return 2;
+	}
+	mkdir(argv[1], 0755);
+
+	dir = subdir(argv[1], "packages_list");
+	gen_packages_list(dir, "300", 300);
+	gen_packages_list(dir, "3000", 3000);
+	gen_malformed_packages_list(dir);
+
+	dir = subdir(argv[1], "apk");
+	for (i = 0; i < sizeof(apks) / sizeof(apks[0]); i++)
+		gen_apk(dir, &apks[i]);
+
+	dir = subdir(argv[1], "allowlist");
+	gen_allowlist(dir, "100", 100);
+	gen_allowlist(dir, "1000", 1000);
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __KSU_H_HOST_SHIM
+#define __KSU_H_HOST_SHIM
+
+// Just enough of the kernel API for file_parser.c to build in userspace.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
+static inline u16 get_unaligned_le16(const void *p)
+{
+	const u8 *b = p;
+	return (u16)(b[0] | b[1] << 8);
+}
+
+static inline u32 get_unaligned_le32(const void *p)
+{
+	const u8 *b = p;
+	return (u32)b[0] | (u32)b[1] << 8 | (u32)b[2] << 16 |
+	       (u32)b[3] << 24;
+}
+
+static inline u64 get_unaligned_le64(const void *p)
+{
+	const u8 *b = p;
+	return (u64)get_unaligned_le32(b) | (u64)get_unaligned_le32(b + 4) << 32;
+}
+
+static inline int kstrtou32(const char *s, unsigned int base, u32 *res)
+{
+	unsigned long val;
+	char *end;
+
+	if (!*s || *s == '-' || *s == ' ')
+		return -EINVAL;
+
+	errno = 0;
+	val = strtoul(s, &end, base);
+	if (*end == '\n')
+		end++;
+	if (*end || errno || val > UINT32_MAX)
+		return -EINVAL;
+
+	*res = (u32)val;
+	return 0;
+}
+
+#endif
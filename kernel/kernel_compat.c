@@ -81,6 +81,16 @@ ssize_t ksu_kernel_write_compat(struct file *p, const void *buf, size_t count,
 	return kernel_write(p, buf, count, pos);
 }
 
+int ksu_vfs_getattr_compat(struct file *p, struct kstat *stat)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return vfs_getattr(&p->f_path, stat, STATX_BASIC_STATS,
+			   AT_STATX_SYNC_AS_STAT);
+#else
+	return vfs_getattr(&p->f_path, stat);
+#endif
+}
+
 long ksu_strncpy_from_user_nofault(char *dst, const void __user *unsafe_addr,
 				   long count)
 {
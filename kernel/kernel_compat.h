@@ -31,5 +31,6 @@ extern ssize_t ksu_kernel_read_compat(struct file *p, void *buf, size_t count,
 				      loff_t *pos);
 extern ssize_t ksu_kernel_write_compat(struct file *p, const void *buf,
 				       size_t count, loff_t *pos);
+extern int ksu_vfs_getattr_compat(struct file *p, struct kstat *stat);
 
 #endif
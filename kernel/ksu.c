@@ -5,11 +5,14 @@
 #include <linux/workqueue.h>
 
 #include "allowlist.h"
+#include "apk_sign.h"
 #include "arch.h"
 #include "core_hook.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksu.h"
+#include "selinux/selinux.h"
 #include "throne_tracker.h"
+#include "timeline.h"
 
 static struct workqueue_struct *ksu_workqueue;
 
@@ -18,6 +21,11 @@ bool ksu_queue_work(struct work_struct *work)
 	return queue_work(ksu_workqueue, work);
 }
 
+bool ksu_queue_delayed_work(struct delayed_work *work, unsigned long delay)
+{
+	return queue_delayed_work(ksu_workqueue, work, delay);
+}
+
 extern int ksu_handle_execveat_sucompat(int *fd, struct filename **filename_ptr,
 					void *argv, void *envp, int *flags);
 
@@ -49,10 +57,14 @@ int __init kernelsu_init(void)
 	pr_alert("*************************************************************");
 #endif
 
+	ksu_timeline_record(KSU_BOOT_MODULE_INIT);
+
 	ksu_core_init();
 
 	ksu_workqueue = alloc_ordered_workqueue("kernelsu_work_queue", 0);
 
+	ksu_sepolicy_init();
+
 	ksu_allowlist_init();
 
 	ksu_throne_tracker_init();
@@ -78,6 +90,12 @@ void kernelsu_exit(void)
 
 	ksu_throne_tracker_exit();
 
+	ksu_apk_sign_exit();
+
+	ksu_timeline_exit();
+
+	ksu_sepolicy_exit();
+
 	destroy_workqueue(ksu_workqueue);
 
 #ifdef CONFIG_KPROBES
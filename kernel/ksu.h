@@ -2,7 +2,9 @@
 #define __KSU_H_KSU
 
 #include <linux/types.h>
+#ifdef __KERNEL__
 #include <linux/workqueue.h>
+#endif
 
 #define KERNEL_SU_VERSION KSU_VERSION
 #define KERNEL_SU_OPTION 0xDEADBEEF
@@ -21,6 +23,8 @@
 #define CMD_SET_APP_PROFILE 11
 #define CMD_UID_GRANTED_ROOT 12
 #define CMD_UID_SHOULD_UMOUNT 13
+#define CMD_SET_SEPOLICY_BATCH 14
+#define CMD_GET_SEPOLICY_DUMP 15
 
 #define EVENT_POST_FS_DATA 1
 #define EVENT_BOOT_COMPLETED 2
@@ -80,8 +84,12 @@ struct app_profile {
 	};
 };
 
+#ifdef __KERNEL__
 bool ksu_queue_work(struct work_struct *work);
 
+bool ksu_queue_delayed_work(struct delayed_work *work, unsigned long delay);
+#endif
+
 static inline int startswith(char *s, char *prefix)
 {
 	return strncmp(s, prefix, strlen(prefix));
@@ -8,7 +8,9 @@
 #include <linux/version.h>
 #include <linux/input-event-codes.h>
 #include <linux/kprobes.h>
+#include <linux/ktime.h>
 #include <linux/printk.h>
+#include <linux/sched.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/workqueue.h>
@@ -19,6 +21,7 @@
 #include "ksud.h"
 #include "kernel_compat.h"
 #include "selinux/selinux.h"
+#include "timeline.h"
 
 static const char KERNEL_SU_RC[] =
 	"\n"
@@ -43,20 +46,27 @@ static const char KERNEL_SU_RC[] =
 
 	"\n";
 
-static void stop_vfs_read_hook();
+static void arm_vfs_read_hook();
+static void stop_vfs_read_hook(const char *reason);
 static void stop_execve_hook();
 static void stop_input_hook();
 
 #ifdef CONFIG_KPROBES
-static struct work_struct stop_vfs_read_work;
+static struct work_struct stop_vfs_read_hook_work;
 static struct work_struct stop_execve_hook_work;
 static struct work_struct stop_input_hook_work;
 #else
-bool ksu_vfs_read_hook __read_mostly = true;
+// vfs_read hook is armed once init enters its second stage
+bool ksu_vfs_read_hook __read_mostly = false;
 bool ksu_execveat_hook __read_mostly = true;
 bool ksu_input_hook __read_mostly = true;
 #endif
 
+// the vfs_read hook only cares about this task reading its rc files,
+// init never exits so we don't hold a reference
+static struct task_struct *second_stage_init __read_mostly;
+static atomic_t vfs_read_hook_stopped = ATOMIC_INIT(0);
+
 u32 ksu_devpts_sid;
 
 void on_post_fs_data(void)
@@ -68,6 +78,7 @@ void on_post_fs_data(void)
 	}
 	done = true;
 	pr_info("on_post_fs_data!\n");
+	ksu_timeline_record(KSU_BOOT_POST_FS_DATA);
 	ksu_load_allow_list();
 	// sanity check, this may influence the performance
 	stop_input_hook();
@@ -145,6 +156,17 @@ static int __maybe_unused count(struct user_arg_ptr argv, int max)
 	return i;
 }
 
+static bool init_second_stage_executed = false;
+
+static void on_second_stage(void)
+{
+	ksu_timeline_record(KSU_BOOT_SECOND_STAGE);
+	apply_kernelsu_rules();
+	init_second_stage_executed = true;
+	ksu_android_ns_fs_check();
+	arm_vfs_read_hook();
+}
+
 // IMPORTANT NOTE: the call from execve_handler_pre WON'T provided correct value for envp and flags in GKI version
 int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 			     struct user_arg_ptr *argv,
@@ -164,7 +186,6 @@ int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 	static const char system_bin_init[] = "/system/bin/init";
 	/* This applies to versions between Android 6 ~ 9  */
 	static const char old_system_init[] = "/init";
-	static bool init_second_stage_executed = false;
 
 	if (!filename_ptr)
 		return 0;
@@ -190,9 +211,7 @@ int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 					first_arg);
 				if (!strcmp(first_arg, "second_stage")) {
 					pr_info("/system/bin/init second_stage executed\n");
-					apply_kernelsu_rules();
-					init_second_stage_executed = true;
-					ksu_android_ns_fs_check();
+					on_second_stage();
 				}
 			} else {
 				pr_err("/system/bin/init parse args err!\n");
@@ -214,9 +233,7 @@ int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 				pr_info("/init first arg: %s\n", first_arg);
 				if (!strcmp(first_arg, "--second-stage")) {
 					pr_info("/init second_stage executed\n");
-					apply_kernelsu_rules();
-					init_second_stage_executed = true;
-					ksu_android_ns_fs_check();
+					on_second_stage();
 				}
 			} else {
 				pr_err("/init parse args err!\n");
@@ -251,10 +268,7 @@ int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 					    (!strcmp(env_value, "1") ||
 					     !strcmp(env_value, "true"))) {
 						pr_info("/init second_stage executed\n");
-						apply_kernelsu_rules();
-						init_second_stage_executed =
-							true;
-						ksu_android_ns_fs_check();
+						on_second_stage();
 					}
 				}
 			}
@@ -264,10 +278,13 @@ int ksu_handle_execveat_ksud(int *fd, struct filename **filename_ptr,
 	if (unlikely(first_app_process && !memcmp(filename->name, app_process,
 						  sizeof(app_process) - 1))) {
 		first_app_process = false;
+		ksu_timeline_record(KSU_BOOT_FIRST_APP_PROCESS);
 		pr_info("exec app_process, /data prepared, second_stage: %d\n",
 			init_second_stage_executed);
 		on_post_fs_data(); // we keep this for old ksud
 		stop_execve_hook();
+		// init has parsed its rc files long before zygote starts
+		stop_vfs_read_hook("app_process");
 	}
 
 	return 0;
@@ -315,7 +332,7 @@ int ksu_handle_vfs_read(struct file **file_ptr, char __user **buf_ptr,
 	char __user *buf;
 	size_t count;
 
-	if (strcmp(current->comm, "init")) {
+	if (current != second_stage_init) {
 		// we are only interest in `init` process
 		return 0;
 	}
@@ -348,8 +365,6 @@ int ksu_handle_vfs_read(struct file **file_ptr, char __user **buf_ptr,
 	// we only process the first read
 	static bool rc_inserted = false;
 	if (rc_inserted) {
-		// we don't need this kprobe, unregister it!
-		stop_vfs_read_hook();
 		return 0;
 	}
 	rc_inserted = true;
@@ -394,12 +409,26 @@ int ksu_handle_vfs_read(struct file **file_ptr, char __user **buf_ptr,
 	*buf_ptr = buf + rc_count;
 	*count_ptr = count - rc_count;
 
+	ksu_timeline_record(KSU_BOOT_RC_INJECTED);
+	// the proxy takes care of the rest, we don't need this hook anymore
+	stop_vfs_read_hook("rc injected");
+
 	return 0;
 }
 
 int ksu_handle_sys_read(unsigned int fd, char __user **buf_ptr,
 			size_t *count_ptr)
 {
+	// every read syscall comes here while the hook is armed, filter out
+	// everything but init before touching the fd table
+	if (likely(current != second_stage_init)) {
+		return 0;
+	}
+	// the kprobe is unregistered from a work item, until then it still fires
+	if (atomic_read(&vfs_read_hook_stopped)) {
+		return 0;
+	}
+
 	struct file *file = fget(fd);
 	if (!file) {
 		return 0;
@@ -529,18 +558,62 @@ static void do_stop_vfs_read_hook(struct work_struct *work)
 static void do_stop_execve_hook(struct work_struct *work)
 {
 	unregister_kprobe(&execve_kp);
+	ksu_timeline_record(KSU_BOOT_EXECVE_HOOK_STOPPED);
 }
 
 static void do_stop_input_hook(struct work_struct *work)
 {
 	unregister_kprobe(&input_event_kp);
+	ksu_timeline_record(KSU_BOOT_INPUT_HOOK_STOPPED);
 }
 #endif
 
-static void stop_vfs_read_hook()
+// in case init never reads atrace.rc, don't keep the hook forever
+#define VFS_READ_HOOK_TIMEOUT (60 * HZ)
+
+static ktime_t vfs_read_hook_armed_at;
+
+static void do_vfs_read_hook_timeout(struct work_struct *work)
+{
+	stop_vfs_read_hook("timeout");
+}
+
+static DECLARE_DELAYED_WORK(vfs_read_hook_timeout_work,
+			    do_vfs_read_hook_timeout);
+
+static void arm_vfs_read_hook()
 {
+	if (atomic_read(&vfs_read_hook_stopped) || second_stage_init)
+		return;
+
+	second_stage_init = current;
+	vfs_read_hook_armed_at = ktime_get();
+	ksu_timeline_record(KSU_BOOT_VFS_READ_HOOK_ARMED);
+#ifdef CONFIG_KPROBES
+	// vfs_read_kp is registered at init already: registering it from here
+	// would need a work item, which races with init reading atrace.rc
+	pr_info("arm vfs_read kprobe for init %d\n", current->pid);
+#else
+	ksu_vfs_read_hook = true;
+	pr_info("arm vfs_read_hook\n");
+#endif
+	schedule_delayed_work(&vfs_read_hook_timeout_work,
+			      VFS_READ_HOOK_TIMEOUT);
+}
+
+static void stop_vfs_read_hook(const char *reason)
+{
+	if (atomic_xchg(&vfs_read_hook_stopped, 1))
+		return;
+
+	cancel_delayed_work(&vfs_read_hook_timeout_work);
+	ksu_timeline_record(KSU_BOOT_VFS_READ_HOOK_STOPPED);
+	if (second_stage_init)
+		pr_info("vfs_read hook stopped by %s, resident for %lld ms\n",
+			reason,
+			ktime_ms_delta(ktime_get(), vfs_read_hook_armed_at));
 #ifdef CONFIG_KPROBES
-	bool ret = schedule_work(&stop_vfs_read_work);
+	bool ret = schedule_work(&stop_vfs_read_hook_work);
 	pr_info("unregister vfs_read kprobe: %d!\n", ret);
 #else
 	ksu_vfs_read_hook = false;
@@ -555,6 +628,7 @@ static void stop_execve_hook()
 	pr_info("unregister execve kprobe: %d!\n", ret);
 #else
 	ksu_execveat_hook = false;
+	ksu_timeline_record(KSU_BOOT_EXECVE_HOOK_STOPPED);
 	pr_info("stop execve_hook\n");
 #endif
 }
@@ -571,6 +645,7 @@ static void stop_input_hook()
 	pr_info("unregister input kprobe: %d!\n", ret);
 #else
 	ksu_input_hook = false;
+	ksu_timeline_record(KSU_BOOT_INPUT_HOOK_STOPPED);
 	pr_info("stop input_hook\n");
 #endif
 }
@@ -581,18 +656,20 @@ void ksu_ksud_init()
 #ifdef CONFIG_KPROBES
 	int ret;
 
+	INIT_WORK(&stop_vfs_read_hook_work, do_stop_vfs_read_hook);
+	INIT_WORK(&stop_execve_hook_work, do_stop_execve_hook);
+	INIT_WORK(&stop_input_hook_work, do_stop_input_hook);
+
 	ret = register_kprobe(&execve_kp);
 	pr_info("ksud: execve_kp: %d\n", ret);
 
+	// only reads of the second stage init pass its handler, see
+	// arm_vfs_read_hook()
 	ret = register_kprobe(&vfs_read_kp);
 	pr_info("ksud: vfs_read_kp: %d\n", ret);
 
 	ret = register_kprobe(&input_event_kp);
 	pr_info("ksud: input_event_kp: %d\n", ret);
-
-	INIT_WORK(&stop_vfs_read_work, do_stop_vfs_read_hook);
-	INIT_WORK(&stop_execve_hook_work, do_stop_execve_hook);
-	INIT_WORK(&stop_input_hook_work, do_stop_input_hook);
 #endif
 }
 
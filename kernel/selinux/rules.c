@@ -1,8 +1,17 @@
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "../klog.h" // IWYU pragma: keep
+#include "../ksu.h"
+#include "../timeline.h"
+#include "avc.h"
 #include "selinux.h"
 #include "sepolicy.h"
 #include "ss/services.h"
@@ -24,108 +33,388 @@ static struct policydb *get_policydb(void)
 	return db;
 }
 
-void apply_kernelsu_rules()
+// serializes policydb writers, the policy itself is only rcu protected
+static DEFINE_MUTEX(ksu_sepolicy_lock);
+
+// the policy our rules were applied to, a policy load replaces it and
+// everything has to be replayed against the new one
+static struct selinux_policy *ksu_patched_policy;
+
+// Accounting of what every rule source added to the policy, so modules that
+// bloat it can be found. Slot 0 is the built-in rule set, slot 1 collects
+// unnamed callers and anything past SEPOL_MAX_SOURCES.
+#define SEPOL_MAX_SOURCES 64
+#define SEPOL_SOURCE_LEN 64
+#define SEPOL_SOURCE_BUILTIN 0
+#define SEPOL_SOURCE_UNKNOWN 1
+
+struct sepol_source {
+	char name[SEPOL_SOURCE_LEN];
+	u32 rules;
+	u32 failed;
+	struct ksu_sepolicy_stats added;
+};
+
+static struct sepol_source sepol_sources[SEPOL_MAX_SOURCES] = {
+	[SEPOL_SOURCE_BUILTIN] = { .name = "builtin" },
+	[SEPOL_SOURCE_UNKNOWN] = { .name = "unknown" },
+};
+static u32 sepol_source_count = 2;
+
+static u32 sepol_source_find(const char *name)
 {
-	if (!getenforce()) {
-		pr_info("SELinux permissive or disabled, apply rules!\n");
-	}
+	u32 i;
 
-	rcu_read_lock();
-	struct policydb *db = get_policydb();
+	if (!name || !*name) {
+		return SEPOL_SOURCE_UNKNOWN;
+	}
+	for (i = 0; i < sepol_source_count; i++) {
+		if (!strcmp(sepol_sources[i].name, name)) {
+			return i;
+		}
+	}
+	if (sepol_source_count == SEPOL_MAX_SOURCES) {
+		return SEPOL_SOURCE_UNKNOWN;
+	}
+	strscpy(sepol_sources[i].name, name, SEPOL_SOURCE_LEN);
+	return sepol_source_count++;
+}
 
-	ksu_permissive(db, KERNEL_SU_DOMAIN);
-	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "mlstrustedsubject");
-	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "netdomain");
-	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "bluetoothdomain");
+static void sepol_account(u32 source, const struct ksu_sepolicy_stats *before,
+			  u32 rules, u32 failed)
+{
+	struct sepol_source *src = &sepol_sources[source];
+	struct ksu_sepolicy_stats now;
 
-	// Create unconstrained file type
-	ksu_type(db, KERNEL_SU_FILE, "file_type");
-	ksu_typeattribute(db, KERNEL_SU_FILE, "mlstrustedobject");
-	ksu_allow(db, ALL, KERNEL_SU_FILE, ALL, ALL);
+	ksu_get_sepolicy_stats(&now);
+	src->rules += rules;
+	src->failed += failed;
+	src->added.avtab_nodes += now.avtab_nodes - before->avtab_nodes;
+	src->added.xperm_nodes += now.xperm_nodes - before->xperm_nodes;
+	src->added.types += now.types - before->types;
+	src->added.len += now.len - before->len;
+}
 
-	// allow all!
-	ksu_allow(db, KERNEL_SU_DOMAIN, ALL, ALL, ALL);
+// a reloaded policy starts from scratch, the replay accounts again
+static void sepol_reset_accounting(void)
+{
+	u32 i;
 
-	// allow us do any ioctl
-	if (db->policyvers >= POLICYDB_VERSION_XPERMS_IOCTL) {
-		ksu_allowxperm(db, KERNEL_SU_DOMAIN, ALL, "blk_file", ALL);
-		ksu_allowxperm(db, KERNEL_SU_DOMAIN, ALL, "fifo_file", ALL);
-		ksu_allowxperm(db, KERNEL_SU_DOMAIN, ALL, "chr_file", ALL);
-		ksu_allowxperm(db, KERNEL_SU_DOMAIN, ALL, "file", ALL);
+	for (i = 0; i < sepol_source_count; i++) {
+		sepol_sources[i].rules = 0;
+		sepol_sources[i].failed = 0;
+		memset(&sepol_sources[i].added, 0,
+		       sizeof(sepol_sources[i].added));
 	}
+}
+
+// Names used by the built-in rules, resolved once per policy. *_ALL entries
+// stay NULL and stand for every type or class.
+enum kernelsu_type {
+	TYPE_ALL,
+	TYPE_SU,
+	TYPE_KSU_FILE,
+	TYPE_KERNEL,
+	TYPE_INIT,
+	TYPE_ZYGOTE,
+	TYPE_SERVICEMANAGER,
+	TYPE_HWSERVICEMANAGER,
+	TYPE_LOGD,
+	TYPE_SYSTEM_SERVER,
+	TYPE_ADB_DATA_FILE,
+	TYPE_APK_DATA_FILE,
+	TYPE_SHELL_DATA_FILE,
+	TYPE_PACKAGES_LIST_FILE,
+	TYPE_SYSTEM_DATA_FILE,
+	TYPE_MAX,
+};
+
+static const char *const kernelsu_types[TYPE_MAX] = {
+	[TYPE_SU] = KERNEL_SU_DOMAIN,
+	[TYPE_KSU_FILE] = KERNEL_SU_FILE,
+	[TYPE_KERNEL] = "kernel",
+	[TYPE_INIT] = "init",
+	[TYPE_ZYGOTE] = "zygote",
+	[TYPE_SERVICEMANAGER] = "servicemanager",
+	[TYPE_HWSERVICEMANAGER] = "hwservicemanager",
+	[TYPE_LOGD] = "logd",
+	[TYPE_SYSTEM_SERVER] = "system_server",
+	[TYPE_ADB_DATA_FILE] = "adb_data_file",
+	[TYPE_APK_DATA_FILE] = "apk_data_file",
+	[TYPE_SHELL_DATA_FILE] = "shell_data_file",
+	[TYPE_PACKAGES_LIST_FILE] = "packages_list_file",
+	[TYPE_SYSTEM_DATA_FILE] = "system_data_file",
+};
+
+enum kernelsu_class {
+	CLASS_ALL,
+	CLASS_FILE,
+	CLASS_DIR,
+	CLASS_FIFO_FILE,
+	CLASS_BLK_FILE,
+	CLASS_CHR_FILE,
+	CLASS_FD,
+	CLASS_PROCESS,
+	CLASS_CAPABILITY,
+	CLASS_BINDER,
+	CLASS_MAX,
+};
+
+static const char *const kernelsu_classes[CLASS_MAX] = {
+	[CLASS_FILE] = "file",
+	[CLASS_DIR] = "dir",
+	[CLASS_FIFO_FILE] = "fifo_file",
+	[CLASS_BLK_FILE] = "blk_file",
+	[CLASS_CHR_FILE] = "chr_file",
+	[CLASS_FD] = "fd",
+	[CLASS_PROCESS] = "process",
+	[CLASS_CAPABILITY] = "capability",
+	[CLASS_BINDER] = "binder",
+};
+
+// types and attributes created by the built-in rules, in one bulk insertion
+static const char *const kernelsu_new_types[] = { KERNEL_SU_FILE };
+static const bool kernelsu_new_attrs[] = { false };
+
+struct kernelsu_rule {
+	u8 src;
+	u8 tgt;
+	u8 cls;
+	const char *perm;
+};
+
+static const struct kernelsu_rule kernelsu_rules[] = {
+	// unconstrained file type
+	{ TYPE_ALL, TYPE_KSU_FILE, CLASS_ALL, ALL },
+
+	// allow all!
+	{ TYPE_SU, TYPE_ALL, CLASS_ALL, ALL },
 
 	// we need to save allowlist in /data/adb/ksu
-	ksu_allow(db, "kernel", "adb_data_file", "dir", ALL);
-	ksu_allow(db, "kernel", "adb_data_file", "file", ALL);
+	{ TYPE_KERNEL, TYPE_ADB_DATA_FILE, CLASS_DIR, ALL },
+	{ TYPE_KERNEL, TYPE_ADB_DATA_FILE, CLASS_FILE, ALL },
 	// we need to search /data/app
-	ksu_allow(db, "kernel", "apk_data_file", "file", "open");
-	ksu_allow(db, "kernel", "apk_data_file", "dir", "open");
-	ksu_allow(db, "kernel", "apk_data_file", "dir", "read");
-	ksu_allow(db, "kernel", "apk_data_file", "dir", "search");
+	{ TYPE_KERNEL, TYPE_APK_DATA_FILE, CLASS_FILE, "open" },
+	{ TYPE_KERNEL, TYPE_APK_DATA_FILE, CLASS_DIR, "open" },
+	{ TYPE_KERNEL, TYPE_APK_DATA_FILE, CLASS_DIR, "read" },
+	{ TYPE_KERNEL, TYPE_APK_DATA_FILE, CLASS_DIR, "search" },
 	// we may need to do mount on shell
-	ksu_allow(db, "kernel", "shell_data_file", "file", ALL);
+	{ TYPE_KERNEL, TYPE_SHELL_DATA_FILE, CLASS_FILE, ALL },
 	// we need to read /data/system/packages.list
-	ksu_allow(db, "kernel", "kernel", "capability", "dac_override");
+	{ TYPE_KERNEL, TYPE_KERNEL, CLASS_CAPABILITY, "dac_override" },
 	// Android 10+:
 	// http://aospxref.com/android-12.0.0_r3/xref/system/sepolicy/private/file_contexts#512
-	ksu_allow(db, "kernel", "packages_list_file", "file", ALL);
+	{ TYPE_KERNEL, TYPE_PACKAGES_LIST_FILE, CLASS_FILE, ALL },
 	// Kernel 4.4
-	ksu_allow(db, "kernel", "packages_list_file", "dir", ALL);
+	{ TYPE_KERNEL, TYPE_PACKAGES_LIST_FILE, CLASS_DIR, ALL },
 	// Android 9-:
 	// http://aospxref.com/android-9.0.0_r61/xref/system/sepolicy/private/file_contexts#360
-	ksu_allow(db, "kernel", "system_data_file", "file", ALL);
-	ksu_allow(db, "kernel", "system_data_file", "dir", ALL);
+	{ TYPE_KERNEL, TYPE_SYSTEM_DATA_FILE, CLASS_FILE, ALL },
+	{ TYPE_KERNEL, TYPE_SYSTEM_DATA_FILE, CLASS_DIR, ALL },
 	// our ksud triggered by init
-	ksu_allow(db, "init", "adb_data_file", "file", ALL);
-	ksu_allow(db, "init", "adb_data_file", "dir", ALL); // #1289
-	ksu_allow(db, "init", KERNEL_SU_DOMAIN, ALL, ALL);
+	{ TYPE_INIT, TYPE_ADB_DATA_FILE, CLASS_FILE, ALL },
+	{ TYPE_INIT, TYPE_ADB_DATA_FILE, CLASS_DIR, ALL }, // #1289
+	{ TYPE_INIT, TYPE_SU, CLASS_ALL, ALL },
 	// we need to umount modules in zygote
-	ksu_allow(db, "zygote", "adb_data_file", "dir", "search");
+	{ TYPE_ZYGOTE, TYPE_ADB_DATA_FILE, CLASS_DIR, "search" },
 
 	// copied from Magisk rules
 	// suRights
-	ksu_allow(db, "servicemanager", KERNEL_SU_DOMAIN, "dir", "search");
-	ksu_allow(db, "servicemanager", KERNEL_SU_DOMAIN, "dir", "read");
-	ksu_allow(db, "servicemanager", KERNEL_SU_DOMAIN, "file", "open");
-	ksu_allow(db, "servicemanager", KERNEL_SU_DOMAIN, "file", "read");
-	ksu_allow(db, "servicemanager", KERNEL_SU_DOMAIN, "process", "getattr");
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "process", "sigchld");
+	{ TYPE_SERVICEMANAGER, TYPE_SU, CLASS_DIR, "search" },
+	{ TYPE_SERVICEMANAGER, TYPE_SU, CLASS_DIR, "read" },
+	{ TYPE_SERVICEMANAGER, TYPE_SU, CLASS_FILE, "open" },
+	{ TYPE_SERVICEMANAGER, TYPE_SU, CLASS_FILE, "read" },
+	{ TYPE_SERVICEMANAGER, TYPE_SU, CLASS_PROCESS, "getattr" },
+	{ TYPE_ALL, TYPE_SU, CLASS_PROCESS, "sigchld" },
 
 	// allowLog
-	ksu_allow(db, "logd", KERNEL_SU_DOMAIN, "dir", "search");
-	ksu_allow(db, "logd", KERNEL_SU_DOMAIN, "file", "read");
-	ksu_allow(db, "logd", KERNEL_SU_DOMAIN, "file", "open");
-	ksu_allow(db, "logd", KERNEL_SU_DOMAIN, "file", "getattr");
+	{ TYPE_LOGD, TYPE_SU, CLASS_DIR, "search" },
+	{ TYPE_LOGD, TYPE_SU, CLASS_FILE, "read" },
+	{ TYPE_LOGD, TYPE_SU, CLASS_FILE, "open" },
+	{ TYPE_LOGD, TYPE_SU, CLASS_FILE, "getattr" },
 
 	// dumpsys
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "fd", "use");
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "fifo_file", "write");
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "fifo_file", "read");
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "fifo_file", "open");
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "fifo_file", "getattr");
+	{ TYPE_ALL, TYPE_SU, CLASS_FD, "use" },
+	{ TYPE_ALL, TYPE_SU, CLASS_FIFO_FILE, "write" },
+	{ TYPE_ALL, TYPE_SU, CLASS_FIFO_FILE, "read" },
+	{ TYPE_ALL, TYPE_SU, CLASS_FIFO_FILE, "open" },
+	{ TYPE_ALL, TYPE_SU, CLASS_FIFO_FILE, "getattr" },
 
 	// bootctl
-	ksu_allow(db, "hwservicemanager", KERNEL_SU_DOMAIN, "dir", "search");
-	ksu_allow(db, "hwservicemanager", KERNEL_SU_DOMAIN, "file", "read");
-	ksu_allow(db, "hwservicemanager", KERNEL_SU_DOMAIN, "file", "open");
-	ksu_allow(db, "hwservicemanager", KERNEL_SU_DOMAIN, "process",
-		  "getattr");
+	{ TYPE_HWSERVICEMANAGER, TYPE_SU, CLASS_DIR, "search" },
+	{ TYPE_HWSERVICEMANAGER, TYPE_SU, CLASS_FILE, "read" },
+	{ TYPE_HWSERVICEMANAGER, TYPE_SU, CLASS_FILE, "open" },
+	{ TYPE_HWSERVICEMANAGER, TYPE_SU, CLASS_PROCESS, "getattr" },
 
 	// For mounting loop devices, mirrors, tmpfs
-	ksu_allow(db, "kernel", ALL, "file", "read");
-	ksu_allow(db, "kernel", ALL, "file", "write");
+	{ TYPE_KERNEL, TYPE_ALL, CLASS_FILE, "read" },
+	{ TYPE_KERNEL, TYPE_ALL, CLASS_FILE, "write" },
 
 	// Allow all binder transactions
-	ksu_allow(db, ALL, KERNEL_SU_DOMAIN, "binder", ALL);
+	{ TYPE_ALL, TYPE_SU, CLASS_BINDER, ALL },
+
+	// Allow system server kill su process
+	{ TYPE_SYSTEM_SERVER, TYPE_SU, CLASS_PROCESS, "getpgid" },
+	{ TYPE_SYSTEM_SERVER, TYPE_SU, CLASS_PROCESS, "sigkill" },
+};
 
-    // Allow system server kill su process
-    ksu_allow(db, "system_server", KERNEL_SU_DOMAIN, "process", "getpgid");
-    ksu_allow(db, "system_server", KERNEL_SU_DOMAIN, "process", "sigkill");
+// allow us do any ioctl
+static const u8 kernelsu_ioctl_classes[] = {
+	CLASS_BLK_FILE,
+	CLASS_FIFO_FILE,
+	CLASS_CHR_FILE,
+	CLASS_FILE,
+};
+
+#define KERNELSU_MISSING_LEN 256
+
+// append " kind:name" to the summary of names missing from the policy
+static void note_missing(char *missing, size_t *len, const char *kind,
+			 const char *name)
+{
+	if (*len < KERNELSU_MISSING_LEN) {
+		*len += scnprintf(missing + *len, KERNELSU_MISSING_LEN - *len,
+				  " %s:%s", kind, name);
+	}
+}
+
+#define KERNELSU_RULE_COUNT                                                    \
+	(ARRAY_SIZE(kernelsu_rules) + ARRAY_SIZE(kernelsu_ioctl_classes))
+
+// must hold rcu and ksu_sepolicy_lock, returns the number of skipped rules
+static unsigned int __apply_kernelsu_rules(struct policydb *db)
+{
+	struct type_datum *types[TYPE_MAX] = {};
+	struct class_datum *classes[CLASS_MAX] = {};
+	char missing[KERNELSU_MISSING_LEN] = "";
+	size_t missing_len = 0;
+	unsigned int i, skipped = 0;
+
+	ksu_permissive(db, KERNEL_SU_DOMAIN);
+	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "mlstrustedsubject");
+	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "netdomain");
+	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "bluetoothdomain");
+
+	// Create unconstrained file type
+	ksu_add_types(db, kernelsu_new_types, kernelsu_new_attrs, NULL,
+		      ARRAY_SIZE(kernelsu_new_types));
+	ksu_typeattribute(db, KERNEL_SU_FILE, "file_type");
+	ksu_typeattribute(db, KERNEL_SU_FILE, "mlstrustedobject");
+
+	// every name is looked up once, rules referring to a missing one are
+	// skipped and reported together below
+	for (i = TYPE_ALL + 1; i < TYPE_MAX; i++) {
+		types[i] = ksu_find_type(db, kernelsu_types[i]);
+		if (!types[i]) {
+			note_missing(missing, &missing_len, "type",
+				     kernelsu_types[i]);
+		}
+	}
+	for (i = CLASS_ALL + 1; i < CLASS_MAX; i++) {
+		classes[i] = ksu_find_class(db, kernelsu_classes[i]);
+		if (!classes[i]) {
+			note_missing(missing, &missing_len, "class",
+				     kernelsu_classes[i]);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kernelsu_rules); i++) {
+		const struct kernelsu_rule *r = &kernelsu_rules[i];
+		struct perm_datum *perm = NULL;
+
+		if ((r->src != TYPE_ALL && !types[r->src]) ||
+		    (r->tgt != TYPE_ALL && !types[r->tgt]) ||
+		    (r->cls != CLASS_ALL && !classes[r->cls])) {
+			skipped++;
+			continue;
+		}
+		if (r->perm) {
+			perm = ksu_find_perm(classes[r->cls], r->perm);
+			if (!perm) {
+				note_missing(missing, &missing_len,
+					     kernelsu_classes[r->cls], r->perm);
+				skipped++;
+				continue;
+			}
+		}
+		ksu_allow_raw(db, types[r->src], types[r->tgt],
+			      classes[r->cls], perm);
+	}
+
+	if (db->policyvers < POLICYDB_VERSION_XPERMS_IOCTL || !types[TYPE_SU]) {
+		skipped += ARRAY_SIZE(kernelsu_ioctl_classes);
+	} else {
+		for (i = 0; i < ARRAY_SIZE(kernelsu_ioctl_classes); i++) {
+			u8 cls = kernelsu_ioctl_classes[i];
+			if (!classes[cls]) {
+				skipped++;
+				continue;
+			}
+			ksu_allowxperm_raw(db, types[TYPE_SU], ALL,
+					   classes[cls]);
+		}
+	}
+
+	if (skipped) {
+		pr_warn("kernelsu rules: %u skipped, missing:%s\n", skipped,
+			missing);
+	}
+	return skipped;
+}
+
+static void do_apply_kernelsu_rules(struct work_struct *work)
+{
+	ktime_t start = ktime_get();
+
+	if (!getenforce()) {
+		pr_info("SELinux permissive or disabled, apply rules!\n");
+	}
+
+	mutex_lock(&ksu_sepolicy_lock);
+	rcu_read_lock();
+	struct policydb *db = get_policydb();
+	u32 avtab_nodes = db->te_avtab.nel;
+	struct ksu_sepolicy_stats before;
+
+	ksu_get_sepolicy_stats(&before);
+	unsigned int skipped = __apply_kernelsu_rules(db);
+	sepol_account(SEPOL_SOURCE_BUILTIN, &before, KERNELSU_RULE_COUNT,
+		      skipped);
+
+	pr_info("avtab: %u nodes before kernelsu rules, %u after\n",
+		avtab_nodes, db->te_avtab.nel);
 
 	rcu_read_unlock();
+	ksu_patched_policy = rcu_access_pointer(selinux_state.policy);
+	mutex_unlock(&ksu_sepolicy_lock);
+
+	pr_info("kernelsu rules applied in %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+	ksu_timeline_record(KSU_BOOT_RULES_APPLIED);
+}
+
+static DECLARE_WORK(kernelsu_rules_work, do_apply_kernelsu_rules);
+
+// Called from the execve kprobe, which must not sleep, so the rules are
+// applied from the workqueue. Every other policy writer takes the lock
+// through sepol_lock() and therefore runs after them.
+void apply_kernelsu_rules()
+{
+	ksu_queue_work(&kernelsu_rules_work);
+}
+
+static void sepol_lock(void)
+{
+	// the work takes ksu_sepolicy_lock itself, wait before locking
+	flush_work(&kernelsu_rules_work);
+	mutex_lock(&ksu_sepolicy_lock);
 }
 
 #define MAX_SEPOL_LEN 128
+#define MAX_SEPOL_OBJS 7
+// upper bound of rules in one CMD_SET_SEPOLICY_BATCH call, callers split
+// larger rule sets and pass SEPOL_BATCH_NO_RESET on all but the last chunk
+#define MAX_SEPOL_BATCH 256
 
 #define CMD_NORMAL_PERM 1
 #define CMD_XPERM 2
@@ -137,6 +426,8 @@ void apply_kernelsu_rules()
 #define CMD_TYPE_CHANGE 8
 #define CMD_GENFSCON 9
 
+#define SEPOL_BATCH_NO_RESET (1 << 0)
+
 struct sepol_data {
 	u32 cmd;
 	u32 subcmd;
@@ -149,23 +440,252 @@ struct sepol_data {
 	char __user *sepol7;
 };
 
-static int get_object(char *buf, char __user *user_object, size_t buf_sz,
-		      char **object)
+struct sepol_batch {
+	u32 count;
+	u32 flags;
+	struct sepol_data __user *rules;
+	// optional, receives 0 or a negative errno for every rule
+	s32 __user *status;
+	// written back: rules that modified the policy / were already present
+	u32 added;
+	u32 present;
+	// optional accounting label such as "module:<id>" or "profile:<pkg>"
+	const char __user *source;
+};
+
+// a rule copied into kernel memory, NULL objects stand for ALL
+struct sepol_rule {
+	u32 cmd;
+	u32 subcmd;
+	const char *sepol[MAX_SEPOL_OBJS];
+	// the type or attribute was created by sepol_batch_create_types
+	bool created;
+};
+
+// objects that must not be NULL for each cmd, bit n is sepol(n + 1)
+static u32 sepol_required_objs(u32 cmd)
 {
-	if (!user_object) {
-		*object = ALL;
+	switch (cmd) {
+	case CMD_NORMAL_PERM:
+		return 0;
+	case CMD_XPERM:
+		return BIT(3) | BIT(4);
+	case CMD_TYPE_STATE:
+	case CMD_ATTR:
+		return BIT(0);
+	case CMD_TYPE:
+	case CMD_TYPE_ATTR:
+		return BIT(0) | BIT(1);
+	case CMD_TYPE_TRANSITION:
+	case CMD_TYPE_CHANGE:
+		return BIT(0) | BIT(1) | BIT(2) | BIT(3);
+	case CMD_GENFSCON:
+		return BIT(0) | BIT(1) | BIT(2);
+	default:
 		return 0;
 	}
+}
 
-	if (strncpy_from_user(buf, user_object, buf_sz) < 0) {
-		return -1;
+// copy the objects of one rule into pool, must not be called with rcu held
+static int copy_sepol_rule(struct sepol_rule *rule,
+			   const struct sepol_data *data, char *pool,
+			   size_t pool_sz, size_t *used)
+{
+	char __user *objs[MAX_SEPOL_OBJS] = { data->sepol1, data->sepol2,
+					      data->sepol3, data->sepol4,
+					      data->sepol5, data->sepol6,
+					      data->sepol7 };
+	u32 required = sepol_required_objs(data->cmd);
+	int i;
+
+	rule->cmd = data->cmd;
+	rule->subcmd = data->subcmd;
+	rule->created = false;
+	for (i = 0; i < MAX_SEPOL_OBJS; i++) {
+		rule->sepol[i] = ALL;
+		if (!objs[i]) {
+			if (required & BIT(i)) {
+				pr_err("sepol: cmd %d missing object %d\n",
+				       data->cmd, i + 1);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		size_t room = min_t(size_t, pool_sz - *used, MAX_SEPOL_LEN);
+		long len = strncpy_from_user(pool + *used, objs[i], room);
+		if (len < 0) {
+			pr_err("sepol: copy object %d failed.\n", i + 1);
+			return -EFAULT;
+		}
+		if ((size_t)len >= room) {
+			pr_err("sepol: object %d too long.\n", i + 1);
+			return -ENAMETOOLONG;
+		}
+		rule->sepol[i] = pool + *used;
+		*used += len + 1;
+	}
+
+	return 0;
+}
+
+static bool apply_normal_perm(struct policydb *db, const struct sepol_rule *r)
+{
+	const char *s = r->sepol[0], *t = r->sepol[1], *c = r->sepol[2],
+		   *p = r->sepol[3];
+
+	switch (r->subcmd) {
+	case 1:
+		return ksu_allow(db, s, t, c, p);
+	case 2:
+		return ksu_deny(db, s, t, c, p);
+	case 3:
+		return ksu_auditallow(db, s, t, c, p);
+	case 4:
+		return ksu_dontaudit(db, s, t, c, p);
+	default:
+		pr_err("sepol: unknown subcmd: %d\n", r->subcmd);
+		return false;
+	}
+}
+
+static bool apply_xperm(struct policydb *db, const struct sepol_rule *r)
+{
+	// sepol4 is the operation, it is always ioctl now!
+	const char *s = r->sepol[0], *t = r->sepol[1], *c = r->sepol[2],
+		   *perm_set = r->sepol[4];
+
+	switch (r->subcmd) {
+	case 1:
+		return ksu_allowxperm(db, s, t, c, perm_set);
+	case 2:
+		return ksu_auditallowxperm(db, s, t, c, perm_set);
+	case 3:
+		return ksu_dontauditxperm(db, s, t, c, perm_set);
+	default:
+		pr_err("sepol: unknown subcmd: %d\n", r->subcmd);
+		return false;
 	}
+}
 
-	*object = buf;
+// must be called with rcu held
+static int apply_sepol_rule(struct policydb *db, const struct sepol_rule *r)
+{
+	const char *const *o = r->sepol;
+	bool success = false;
 
+	switch (r->cmd) {
+	case CMD_NORMAL_PERM:
+		success = apply_normal_perm(db, r);
+		break;
+	case CMD_XPERM:
+		success = apply_xperm(db, r);
+		break;
+	case CMD_TYPE_STATE:
+		if (r->subcmd == 1) {
+			success = ksu_permissive(db, o[0]);
+		} else if (r->subcmd == 2) {
+			success = ksu_enforce(db, o[0]);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", r->subcmd);
+		}
+		break;
+	case CMD_TYPE:
+		success = r->created ? ksu_typeattribute(db, o[0], o[1]) :
+				       ksu_type(db, o[0], o[1]);
+		break;
+	case CMD_TYPE_ATTR:
+		success = ksu_typeattribute(db, o[0], o[1]);
+		break;
+	case CMD_ATTR:
+		success = r->created || ksu_attribute(db, o[0]);
+		break;
+	case CMD_TYPE_TRANSITION:
+		success = ksu_type_transition(db, o[0], o[1], o[2], o[3], o[4]);
+		break;
+	case CMD_TYPE_CHANGE:
+		if (r->subcmd == 1) {
+			success = ksu_type_change(db, o[0], o[1], o[2], o[3]);
+		} else if (r->subcmd == 2) {
+			success = ksu_type_member(db, o[0], o[1], o[2], o[3]);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", r->subcmd);
+		}
+		break;
+	case CMD_GENFSCON:
+		success = ksu_genfscon(db, o[0], o[1], o[2]);
+		break;
+	default:
+		pr_err("sepol: unknown cmd: %d\n", r->cmd);
+		return -EINVAL;
+	}
+
+	if (!success) {
+		pr_err("sepol: %d failed.\n", r->cmd);
+		return -EINVAL;
+	}
 	return 0;
 }
 
+// This is not targeted invalidation: the avc cache and its node helpers are
+// private to security/selinux/avc.c, so the only way to drop a stale entry
+// is a global avc_ss_reset(). What is decided here is only whether a
+// transaction needs that reset at all. It is skipped when every new rule
+// involves a type created in the same transaction (no sid, so nothing can be
+// cached for it yet) or is a type/labeling rule the avc never caches. Any
+// other rule, i.e. nearly every module rule, still flushes the whole cache.
+// Both are protected by ksu_sepolicy_lock.
+static u32 sepol_txn_types; // p_types.nprim when the transaction began
+static bool avc_flush_pending;
+
+static void sepol_txn_begin(struct policydb *db)
+{
+	if (!sepol_txn_types) {
+		sepol_txn_types = db->p_types.nprim;
+	}
+}
+
+// returns true if the avc has to be flushed for the finished transaction
+static bool sepol_txn_end(void)
+{
+	bool flush = avc_flush_pending;
+
+	sepol_txn_types = 0;
+	avc_flush_pending = false;
+	return flush;
+}
+
+static bool sepol_is_new_type(struct policydb *db, const char *type)
+{
+	return ksu_type_value(db, type) > sepol_txn_types;
+}
+
+// whether an applied rule may change a decision the avc has cached, and
+// with it force the global reset
+static bool sepol_rule_touches_avc(struct policydb *db,
+				   const struct sepol_rule *r)
+{
+	const char *const *o = r->sepol;
+
+	switch (r->cmd) {
+	case CMD_NORMAL_PERM:
+	case CMD_XPERM:
+		// wildcards touch every type
+		if (!o[0] || !o[1]) {
+			return true;
+		}
+		// nothing can be cached for a pair with a new type on either side
+		return !sepol_is_new_type(db, o[0]) &&
+		       !sepol_is_new_type(db, o[1]);
+	case CMD_TYPE_STATE:
+	case CMD_TYPE:
+	case CMD_TYPE_ATTR:
+		return !sepol_is_new_type(db, o[0]);
+	default:
+		return false;
+	}
+}
+
 // reset avc cache table, otherwise the new rules will not take effect if already denied
 static void reset_avc_cache()
 {
@@ -182,6 +702,347 @@ static void reset_avc_cache()
 	selinux_xfrm_notify_policyload();
 }
 
+// Rules pushed by userspace are lost when a new policy is loaded. They are
+// kept in a journal with their names interned in a string pool (types and
+// classes are renumbered by a reload, so resolved values can't be kept),
+// and replayed together with the built-in rules once a reload is noticed.
+// Everything below is protected by ksu_sepolicy_lock.
+#define SEPOL_JOURNAL_MAX_RULES 8192
+#define SEPOL_JOURNAL_MAX_POOL (256 * 1024)
+
+struct sepol_journal_entry {
+	u32 cmd;
+	u32 subcmd;
+	// offset in the string pool plus one, 0 stands for ALL
+	u32 obj[MAX_SEPOL_OBJS];
+	// not part of the rule identity, the first source pushing it wins
+	u32 source;
+};
+
+// A rule pushed again moves to the end of the journal: the replay has to end
+// in the state of the live policy, and with allow, deny, allow of the same
+// rule that is the last push. Its old slot stays behind as a hole (cmd 0)
+// until the journal is compacted.
+
+#define SEPOL_JOURNAL_KEY_LEN offsetof(struct sepol_journal_entry, source)
+
+struct sepol_journal_node {
+	struct hlist_node node;
+	u32 index; // journal entry index or string pool offset
+};
+
+static struct sepol_journal_entry *journal;
+static u32 journal_count, journal_cap, journal_holes;
+static char *journal_pool;
+static u32 journal_pool_len, journal_pool_cap;
+static bool journal_full;
+static DEFINE_HASHTABLE(journal_strings, 8);
+static DEFINE_HASHTABLE(journal_rules, 10);
+
+static struct work_struct sepol_replay_work;
+
+static void *journal_grow(void *old, size_t used, size_t size)
+{
+	void *new = vmalloc(size);
+	if (!new) {
+		return NULL;
+	}
+	if (old) {
+		memcpy(new, old, used);
+		vfree(old);
+	}
+	return new;
+}
+
+static int journal_intern(const char *str, u32 *offset)
+{
+	size_t len = strlen(str);
+	u32 hash = full_name_hash(NULL, str, len);
+	struct sepol_journal_node *n;
+
+	hash_for_each_possible (journal_strings, n, node, hash) {
+		if (!strcmp(journal_pool + n->index, str)) {
+			*offset = n->index;
+			return 0;
+		}
+	}
+
+	if (journal_pool_len + len + 1 > journal_pool_cap) {
+		u32 cap = max_t(u32, journal_pool_cap * 2, PAGE_SIZE);
+		if (cap > SEPOL_JOURNAL_MAX_POOL) {
+			return -ENOSPC;
+		}
+		char *pool = journal_grow(journal_pool, journal_pool_len, cap);
+		if (!pool) {
+			return -ENOMEM;
+		}
+		journal_pool = pool;
+		journal_pool_cap = cap;
+	}
+
+	n = kmalloc(sizeof(*n), GFP_KERNEL);
+	if (!n) {
+		return -ENOMEM;
+	}
+	n->index = journal_pool_len;
+	memcpy(journal_pool + journal_pool_len, str, len + 1);
+	journal_pool_len += len + 1;
+	hash_add(journal_strings, &n->node, hash);
+
+	*offset = n->index;
+	return 0;
+}
+
+static inline u32 sepol_journal_hash(const struct sepol_journal_entry *e)
+{
+	return full_name_hash(NULL, (const char *)e, SEPOL_JOURNAL_KEY_LEN);
+}
+
+static void sepol_journal_compact(void)
+{
+	struct sepol_journal_node *n;
+	u32 i, j = 0;
+
+	for (i = 0; i < journal_count; i++) {
+		if (!journal[i].cmd) {
+			continue;
+		}
+		hash_for_each_possible (journal_rules, n, node,
+					sepol_journal_hash(&journal[i])) {
+			if (n->index == i) {
+				n->index = j;
+				break;
+			}
+		}
+		journal[j++] = journal[i];
+	}
+	journal_count = j;
+	journal_holes = 0;
+}
+
+static int sepol_journal_add(const struct sepol_rule *r, u32 source)
+{
+	struct sepol_journal_entry e = { .cmd = r->cmd,
+					 .subcmd = r->subcmd,
+					 .source = source };
+	struct sepol_journal_node *n, *dup = NULL;
+	int i, ret;
+
+	if (journal_full) {
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < MAX_SEPOL_OBJS; i++) {
+		u32 offset;
+		if (!r->sepol[i]) {
+			continue;
+		}
+		ret = journal_intern(r->sepol[i], &offset);
+		if (ret) {
+			goto full;
+		}
+		e.obj[i] = offset + 1;
+	}
+
+	// interned names make equal rules bitwise equal
+	u32 hash = sepol_journal_hash(&e);
+	hash_for_each_possible (journal_rules, n, node, hash) {
+		if (!memcmp(&journal[n->index], &e, SEPOL_JOURNAL_KEY_LEN)) {
+			dup = n;
+			break;
+		}
+	}
+	if (dup && dup->index == journal_count - 1) {
+		return 0;
+	}
+
+	if (journal_count == journal_cap && journal_holes) {
+		sepol_journal_compact();
+	}
+	if (journal_count == journal_cap) {
+		u32 cap = max_t(u32, journal_cap * 2, 256);
+		if (cap > SEPOL_JOURNAL_MAX_RULES) {
+			ret = -ENOSPC;
+			goto full;
+		}
+		struct sepol_journal_entry *entries = journal_grow(
+			journal, journal_count * sizeof(e), cap * sizeof(e));
+		if (!entries) {
+			ret = -ENOMEM;
+			goto full;
+		}
+		journal = entries;
+		journal_cap = cap;
+	}
+
+	if (dup) {
+		e.source = journal[dup->index].source;
+		journal[dup->index].cmd = 0;
+		journal_holes++;
+		dup->index = journal_count;
+		journal[journal_count++] = e;
+		return 0;
+	}
+
+	n = kmalloc(sizeof(*n), GFP_KERNEL);
+	if (!n) {
+		ret = -ENOMEM;
+		goto full;
+	}
+	n->index = journal_count;
+	journal[journal_count++] = e;
+	hash_add(journal_rules, &n->node, hash);
+	return 0;
+
+full:
+	journal_full = true;
+	pr_warn("sepol: journal full (%d), later rules won't survive a policy reload\n",
+		ret);
+	return ret;
+}
+
+static void sepol_journal_rule(const struct sepol_journal_entry *e,
+			       struct sepol_rule *r)
+{
+	int i;
+
+	r->cmd = e->cmd;
+	r->subcmd = e->subcmd;
+	r->created = false;
+	for (i = 0; i < MAX_SEPOL_OBJS; i++) {
+		r->sepol[i] = e->obj[i] ? journal_pool + e->obj[i] - 1 : ALL;
+	}
+}
+
+// must hold ksu_sepolicy_lock
+static void sepol_check_reload(void)
+{
+	struct selinux_policy *policy;
+	struct sepol_rule rule;
+	u32 i, failed = 0;
+
+	policy = rcu_access_pointer(selinux_state.policy);
+	if (!ksu_patched_policy || policy == ksu_patched_policy) {
+		return;
+	}
+
+	ktime_t start = ktime_get();
+	struct ksu_sepolicy_stats before;
+
+	sepol_reset_accounting();
+
+	rcu_read_lock();
+	struct policydb *db = get_policydb();
+	ksu_get_sepolicy_stats(&before);
+	unsigned int skipped = __apply_kernelsu_rules(db);
+	sepol_account(SEPOL_SOURCE_BUILTIN, &before, KERNELSU_RULE_COUNT,
+		      skipped);
+	for (i = 0; i < journal_count; i++) {
+		bool ok;
+
+		if (!journal[i].cmd) {
+			continue;
+		}
+		sepol_journal_rule(&journal[i], &rule);
+		ksu_get_sepolicy_stats(&before);
+		ok = !apply_sepol_rule(db, &rule);
+		sepol_account(journal[i].source, &before, 1, !ok);
+		if (!ok) {
+			failed++;
+		}
+	}
+	ksu_patched_policy = rcu_dereference(selinux_state.policy);
+	rcu_read_unlock();
+
+	// whatever was pending belonged to the old policy
+	sepol_txn_types = 0;
+	avc_flush_pending = false;
+	reset_avc_cache();
+
+	pr_info("sepol: policy reloaded, replayed built-in rules and %u journaled rules (%u failed) in %lld us\n",
+		journal_count - journal_holes, failed,
+		ktime_us_delta(ktime_get(), start));
+}
+
+void ksu_sepolicy_check_reload(void)
+{
+	struct selinux_policy *policy;
+
+	// callers may rely on the built-in rules, e.g. to grant root
+	flush_work(&kernelsu_rules_work);
+
+	// unlocked peek, the common case is that nothing happened
+	policy = rcu_access_pointer(selinux_state.policy);
+	if (!READ_ONCE(ksu_patched_policy) ||
+	    policy == READ_ONCE(ksu_patched_policy)) {
+		return;
+	}
+
+	mutex_lock(&ksu_sepolicy_lock);
+	sepol_check_reload();
+	mutex_unlock(&ksu_sepolicy_lock);
+}
+
+static void do_sepol_replay(struct work_struct *work)
+{
+	ksu_sepolicy_check_reload();
+}
+
+#ifndef MODULE
+// called on every avc reset, which includes the one done by a policy load
+static int ksu_avc_reset_callback(u32 event)
+{
+	if (event == AVC_CALLBACK_RESET) {
+		struct selinux_policy *policy =
+			rcu_access_pointer(selinux_state.policy);
+		if (READ_ONCE(ksu_patched_policy) &&
+		    policy != READ_ONCE(ksu_patched_policy)) {
+			ksu_queue_work(&sepol_replay_work);
+		}
+	}
+	return 0;
+}
+#endif
+
+void __init ksu_sepolicy_init(void)
+{
+	INIT_WORK(&sepol_replay_work, do_sepol_replay);
+#ifndef MODULE
+	// avc_add_callback is __init and not exported, a loadable module
+	// notices reloads on the next sepolicy command only
+	if (avc_add_callback(ksu_avc_reset_callback, AVC_CALLBACK_RESET)) {
+		pr_err("sepol: register avc callback failed\n");
+	}
+#endif
+}
+
+void ksu_sepolicy_exit(void)
+{
+	struct sepol_journal_node *n;
+	struct hlist_node *tmp;
+	int bkt;
+
+	cancel_work_sync(&sepol_replay_work);
+	cancel_work_sync(&kernelsu_rules_work);
+
+	mutex_lock(&ksu_sepolicy_lock);
+	hash_for_each_safe (journal_strings, bkt, tmp, n, node) {
+		hash_del(&n->node);
+		kfree(n);
+	}
+	hash_for_each_safe (journal_rules, bkt, tmp, n, node) {
+		hash_del(&n->node);
+		kfree(n);
+	}
+	vfree(journal);
+	vfree(journal_pool);
+	journal = NULL;
+	journal_pool = NULL;
+	journal_count = journal_cap = journal_holes = 0;
+	journal_pool_len = journal_pool_cap = 0;
+	mutex_unlock(&ksu_sepolicy_lock);
+}
+
 int handle_sepolicy(unsigned long arg3, void __user *arg4)
 {
 	if (!arg4) {
@@ -198,266 +1059,456 @@ int handle_sepolicy(unsigned long arg3, void __user *arg4)
 		return -1;
 	}
 
-	u32 cmd = data.cmd;
-	u32 subcmd = data.subcmd;
+	char *pool = kmalloc(MAX_SEPOL_OBJS * MAX_SEPOL_LEN, GFP_KERNEL);
+	if (!pool) {
+		return -1;
+	}
 
-	rcu_read_lock();
+	struct sepol_rule rule;
+	size_t used = 0;
+	int ret = copy_sepol_rule(&rule, &data, pool,
+				  MAX_SEPOL_OBJS * MAX_SEPOL_LEN, &used);
+	if (ret) {
+		goto out;
+	}
 
+	sepol_lock();
+	sepol_check_reload();
+	rcu_read_lock();
 	struct policydb *db = get_policydb();
+	sepol_txn_begin(db);
+	struct ksu_sepolicy_stats before;
+	ksu_get_sepolicy_stats(&before);
+	u32 gen = ksu_policy_generation();
+	ret = apply_sepol_rule(db, &rule);
+	if (!ret && gen != ksu_policy_generation() &&
+	    sepol_rule_touches_avc(db, &rule)) {
+		avc_flush_pending = true;
+	}
+	rcu_read_unlock();
+	sepol_account(SEPOL_SOURCE_UNKNOWN, &before, 1, ret ? 1 : 0);
+	if (!ret) {
+		sepol_journal_add(&rule, SEPOL_SOURCE_UNKNOWN);
+	}
+	bool flush = sepol_txn_end();
+	mutex_unlock(&ksu_sepolicy_lock);
 
-	int ret = -1;
-	if (cmd == CMD_NORMAL_PERM) {
-		char src_buf[MAX_SEPOL_LEN];
-		char tgt_buf[MAX_SEPOL_LEN];
-		char cls_buf[MAX_SEPOL_LEN];
-		char perm_buf[MAX_SEPOL_LEN];
+	if (flush) {
+		reset_avc_cache();
+	}
 
-		char *s, *t, *c, *p;
-		if (get_object(src_buf, data.sepol1, sizeof(src_buf), &s) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
+out:
+	kfree(pool);
+	return ret ? -1 : 0;
+}
 
-		if (get_object(tgt_buf, data.sepol2, sizeof(tgt_buf), &t) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
+static inline bool sepol_rule_declares_type(const struct sepol_rule *r)
+{
+	return r->cmd == CMD_TYPE || r->cmd == CMD_ATTR;
+}
+
+// Create every type and attribute declared by a batch up front, so the
+// policydb arrays are grown once per batch rather than once per statement.
+// decl has room for count names and 2 * count flags, must hold rcu.
+static void sepol_batch_create_types(struct policydb *db,
+				     struct sepol_rule *rules,
+				     const s32 *status, u32 count, void *decl)
+{
+	const char **names = decl;
+	bool *attrs = (bool *)(names + count);
+	bool *created = attrs + count;
+	u32 i, n = 0;
 
-		if (get_object(cls_buf, data.sepol3, sizeof(cls_buf), &c) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
+	for (i = 0; i < count; i++) {
+		if (!status[i] && sepol_rule_declares_type(&rules[i])) {
+			names[n] = rules[i].sepol[0];
+			attrs[n] = rules[i].cmd == CMD_ATTR;
+			n++;
 		}
+	}
+	if (n < 2) {
+		// nothing to gain over the per statement path
+		return;
+	}
 
-		if (get_object(perm_buf, data.sepol4, sizeof(perm_buf), &p) <
-		    0) {
-			pr_err("sepol: copy perm failed.\n");
-			goto exit;
-		}
-
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_allow(db, s, t, c, p);
-		} else if (subcmd == 2) {
-			success = ksu_deny(db, s, t, c, p);
-		} else if (subcmd == 3) {
-			success = ksu_auditallow(db, s, t, c, p);
-		} else if (subcmd == 4) {
-			success = ksu_dontaudit(db, s, t, c, p);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
+	int ret = ksu_add_types(db, names, attrs, created, n);
+	if (ret < 0) {
+		pr_err("sepol: bulk type creation failed: %d\n", ret);
+	}
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (!status[i] && sepol_rule_declares_type(&rules[i])) {
+			rules[i].created = created[n++];
 		}
-		ret = success ? 0 : -1;
+	}
+}
 
-	} else if (cmd == CMD_XPERM) {
-		char src_buf[MAX_SEPOL_LEN];
-		char tgt_buf[MAX_SEPOL_LEN];
-		char cls_buf[MAX_SEPOL_LEN];
+// Apply a packed array of rules with a single policy access and at most one
+// avc reset at the end, the result of every rule is reported in status.
+int handle_sepolicy_batch(void __user *arg)
+{
+	struct sepol_batch batch;
+	struct policydb *db;
+	struct sepol_data *data = NULL;
+	struct sepol_rule *rules = NULL;
+	s32 *status = NULL;
+	char *pool = NULL;
+	void *decl = NULL;
+	char source_name[SEPOL_SOURCE_LEN] = "";
+	struct ksu_sepolicy_stats before;
+	u32 source;
+	size_t pool_sz, used = 0;
+	u32 i, gen, failed = 0, touched = 0;
+	bool flush = false;
+	int ret = -EINVAL;
 
-		char __maybe_unused
-			operation[MAX_SEPOL_LEN]; // it is always ioctl now!
-		char perm_set[MAX_SEPOL_LEN];
+	if (!arg) {
+		return -EINVAL;
+	}
 
-		char *s, *t, *c;
-		if (get_object(src_buf, data.sepol1, sizeof(src_buf), &s) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (get_object(tgt_buf, data.sepol2, sizeof(tgt_buf), &t) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (get_object(cls_buf, data.sepol3, sizeof(cls_buf), &c) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(operation, data.sepol4,
-				      sizeof(operation)) < 0) {
-			pr_err("sepol: copy operation failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(perm_set, data.sepol5, sizeof(perm_set)) <
-		    0) {
-			pr_err("sepol: copy perm_set failed.\n");
-			goto exit;
-		}
+	if (copy_from_user(&batch, arg, sizeof(batch))) {
+		pr_err("sepol: copy sepol_batch failed.\n");
+		return -EFAULT;
+	}
 
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_allowxperm(db, s, t, c, perm_set);
-		} else if (subcmd == 2) {
-			success = ksu_auditallowxperm(db, s, t, c, perm_set);
-		} else if (subcmd == 3) {
-			success = ksu_dontauditxperm(db, s, t, c, perm_set);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		ret = success ? 0 : -1;
-	} else if (cmd == CMD_TYPE_STATE) {
-		char src[MAX_SEPOL_LEN];
+	if (!batch.count || batch.count > MAX_SEPOL_BATCH || !batch.rules) {
+		pr_err("sepol: invalid batch of %u rules\n", batch.count);
+		return -EINVAL;
+	}
 
-		if (strncpy_from_user(src, data.sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
+	pool_sz = (size_t)batch.count * MAX_SEPOL_OBJS * MAX_SEPOL_LEN;
+	data = vmalloc(batch.count * sizeof(*data));
+	rules = vmalloc(batch.count * sizeof(*rules));
+	status = vmalloc(batch.count * sizeof(*status));
+	pool = vmalloc(pool_sz);
+	decl = vmalloc(batch.count * (sizeof(char *) + 2 * sizeof(bool)));
+	if (!data || !rules || !status || !pool || !decl) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_permissive(db, src);
-		} else if (subcmd == 2) {
-			success = ksu_enforce(db, src);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		if (success)
-			ret = 0;
+	if (copy_from_user(data, batch.rules, batch.count * sizeof(*data))) {
+		pr_err("sepol: copy batch rules failed.\n");
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (batch.source &&
+	    strncpy_from_user(source_name, batch.source, sizeof(source_name)) <
+		    0) {
+		pr_err("sepol: copy batch source failed.\n");
+		ret = -EFAULT;
+		goto out;
+	}
+	source_name[sizeof(source_name) - 1] = '\0';
 
-	} else if (cmd == CMD_TYPE || cmd == CMD_TYPE_ATTR) {
-		char type[MAX_SEPOL_LEN];
-		char attr[MAX_SEPOL_LEN];
+	// fault in every object before touching the policy
+	for (i = 0; i < batch.count; i++) {
+		status[i] = copy_sepol_rule(&rules[i], &data[i], pool, pool_sz,
+					    &used);
+	}
 
-		if (strncpy_from_user(type, data.sepol1, sizeof(type)) < 0) {
-			pr_err("sepol: copy type failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(attr, data.sepol2, sizeof(attr)) < 0) {
-			pr_err("sepol: copy attr failed.\n");
-			goto exit;
+	sepol_lock();
+	sepol_check_reload();
+	rcu_read_lock();
+	db = get_policydb();
+	source = sepol_source_find(source_name);
+	ksu_get_sepolicy_stats(&before);
+	sepol_txn_begin(db);
+	sepol_batch_create_types(db, rules, status, batch.count, decl);
+	batch.added = batch.present = 0;
+	for (i = 0; i < batch.count; i++) {
+		if (status[i]) {
+			failed++;
+			continue;
 		}
-
-		bool success = false;
-		if (cmd == CMD_TYPE) {
-			success = ksu_type(db, type, attr);
+		gen = ksu_policy_generation();
+		status[i] = apply_sepol_rule(db, &rules[i]);
+		if (status[i]) {
+			failed++;
+		} else if (gen == ksu_policy_generation() &&
+			   !rules[i].created) {
+			// already in effect, nothing new for the avc either
+			batch.present++;
 		} else {
-			success = ksu_typeattribute(db, type, attr);
+			batch.added++;
+			if (sepol_rule_touches_avc(db, &rules[i])) {
+				touched++;
+			}
 		}
-		if (!success) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
+	}
+	rcu_read_unlock();
+	sepol_account(source, &before, batch.count, failed);
+	for (i = 0; i < batch.count; i++) {
+		if (!status[i]) {
+			sepol_journal_add(&rules[i], source);
 		}
-		ret = 0;
+	}
+	if (touched) {
+		avc_flush_pending = true;
+	}
+	if (!(batch.flags & SEPOL_BATCH_NO_RESET)) {
+		flush = sepol_txn_end();
+	}
+	mutex_unlock(&ksu_sepolicy_lock);
 
-	} else if (cmd == CMD_ATTR) {
-		char attr[MAX_SEPOL_LEN];
+	if (flush) {
+		reset_avc_cache();
+	}
 
-		if (strncpy_from_user(attr, data.sepol1, sizeof(attr)) < 0) {
-			pr_err("sepol: copy attr failed.\n");
-			goto exit;
-		}
-		if (!ksu_attribute(db, attr)) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
-		}
-		ret = 0;
+	pr_info("sepol: batch of %u rules: %u new, %u present, %u failed, %u touch cached decisions%s\n",
+		batch.count, batch.added, batch.present, failed, touched,
+		flush ? ", global avc reset" : "");
 
-	} else if (cmd == CMD_TYPE_TRANSITION) {
-		char src[MAX_SEPOL_LEN];
-		char tgt[MAX_SEPOL_LEN];
-		char cls[MAX_SEPOL_LEN];
-		char default_type[MAX_SEPOL_LEN];
-		char object[MAX_SEPOL_LEN];
+	ret = 0;
+	if (batch.status &&
+	    copy_to_user(batch.status, status, batch.count * sizeof(*status))) {
+		pr_err("sepol: copy batch status failed.\n");
+		ret = -EFAULT;
+	}
+	if (copy_to_user(arg, &batch, sizeof(batch))) {
+		pr_err("sepol: copy batch counters failed.\n");
+		ret = -EFAULT;
+	}
 
-		if (strncpy_from_user(src, data.sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(tgt, data.sepol2, sizeof(tgt)) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(cls, data.sepol3, sizeof(cls)) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(default_type, data.sepol4,
-				      sizeof(default_type)) < 0) {
-			pr_err("sepol: copy default_type failed.\n");
-			goto exit;
-		}
-		char *real_object;
-		if (data.sepol5 == NULL) {
-			real_object = NULL;
-		} else {
-			if (strncpy_from_user(object, data.sepol5,
-					      sizeof(object)) < 0) {
-				pr_err("sepol: copy object failed.\n");
-				goto exit;
+out:
+	vfree(decl);
+	vfree(pool);
+	vfree(status);
+	vfree(rules);
+	vfree(data);
+	return ret;
+}
+
+// CMD_GET_SEPOLICY_DUMP renders everything KernelSU added to the policy in
+// sepolicy.rule syntax, preceded by per source accounting comments. The
+// required length is always reported back so a short buffer can be retried.
+struct sepol_dump {
+	char *buf;
+	size_t cap;
+	size_t len;
+};
+
+static __printf(2, 3) void sepol_dump_printf(struct sepol_dump *d,
+					      const char *fmt, ...)
+{
+	size_t room = d->len < d->cap ? d->cap - d->len : 0;
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(room ? d->buf + d->len : NULL, room, fmt, args);
+	va_end(args);
+	if (n > 0) {
+		d->len += n;
+	}
+}
+
+static const char *sepol_dump_name(const char *name)
+{
+	return name ? name : "*";
+}
+
+static const char *sepol_rule_keyword(u32 cmd, u32 subcmd)
+{
+	static const char *const perm[] = { "allow", "deny", "auditallow",
+					    "dontaudit" };
+	static const char *const xperm[] = { "allowxperm", "auditallowxperm",
+					     "dontauditxperm" };
+
+	switch (cmd) {
+	case CMD_NORMAL_PERM:
+		return subcmd - 1 < ARRAY_SIZE(perm) ? perm[subcmd - 1] : NULL;
+	case CMD_XPERM:
+		return subcmd - 1 < ARRAY_SIZE(xperm) ? xperm[subcmd - 1] :
+							NULL;
+	case CMD_TYPE_STATE:
+		return subcmd == 1 ? "permissive" :
+		       subcmd == 2 ? "enforce" :
+				     NULL;
+	case CMD_TYPE:
+		return "type";
+	case CMD_TYPE_ATTR:
+		return "typeattribute";
+	case CMD_ATTR:
+		return "attribute";
+	case CMD_TYPE_TRANSITION:
+		return "type_transition";
+	case CMD_TYPE_CHANGE:
+		return subcmd == 1 ? "type_change" :
+		       subcmd == 2 ? "type_member" :
+				     NULL;
+	case CMD_GENFSCON:
+		return "genfscon";
+	default:
+		return NULL;
+	}
+}
+
+static int sepol_rule_objs(const struct sepol_rule *r)
+{
+	switch (r->cmd) {
+	case CMD_NORMAL_PERM:
+		return 4;
+	case CMD_XPERM:
+		return 5;
+	case CMD_TYPE_STATE:
+	case CMD_ATTR:
+		return 1;
+	case CMD_TYPE:
+	case CMD_TYPE_ATTR:
+		return 2;
+	case CMD_TYPE_TRANSITION:
+		// the object name is optional
+		return r->sepol[4] ? 5 : 4;
+	case CMD_TYPE_CHANGE:
+		return 4;
+	case CMD_GENFSCON:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+static void sepol_dump_rule(struct sepol_dump *d, const struct sepol_rule *r)
+{
+	const char *keyword = sepol_rule_keyword(r->cmd, r->subcmd);
+	int i, n = sepol_rule_objs(r);
+
+	if (!keyword) {
+		sepol_dump_printf(d, "# unknown rule %u/%u\n", r->cmd,
+				  r->subcmd);
+		return;
+	}
+	sepol_dump_printf(d, "%s", keyword);
+	for (i = 0; i < n; i++) {
+		sepol_dump_printf(d, " %s", sepol_dump_name(r->sepol[i]));
+	}
+	sepol_dump_printf(d, "\n");
+}
+
+static void sepol_dump_builtin(struct sepol_dump *d)
+{
+	unsigned int i;
+
+	sepol_dump_printf(d, "permissive %s\n", KERNEL_SU_DOMAIN);
+	sepol_dump_printf(d, "typeattribute %s mlstrustedsubject\n",
+			  KERNEL_SU_DOMAIN);
+	sepol_dump_printf(d, "typeattribute %s netdomain\n", KERNEL_SU_DOMAIN);
+	sepol_dump_printf(d, "typeattribute %s bluetoothdomain\n",
+			  KERNEL_SU_DOMAIN);
+	sepol_dump_printf(d, "type %s file_type\n", KERNEL_SU_FILE);
+	sepol_dump_printf(d, "typeattribute %s mlstrustedobject\n",
+			  KERNEL_SU_FILE);
+	for (i = 0; i < ARRAY_SIZE(kernelsu_rules); i++) {
+		const struct kernelsu_rule *r = &kernelsu_rules[i];
+
+		sepol_dump_printf(d, "allow %s %s %s %s\n",
+				  sepol_dump_name(kernelsu_types[r->src]),
+				  sepol_dump_name(kernelsu_types[r->tgt]),
+				  sepol_dump_name(kernelsu_classes[r->cls]),
+				  sepol_dump_name(r->perm));
+	}
+	for (i = 0; i < ARRAY_SIZE(kernelsu_ioctl_classes); i++) {
+		sepol_dump_printf(
+			d, "allowxperm %s * %s ioctl *\n", KERNEL_SU_DOMAIN,
+			kernelsu_classes[kernelsu_ioctl_classes[i]]);
+	}
+}
+
+static void sepol_dump_source_stats(struct sepol_dump *d, const char *name,
+				    u32 rules, u32 failed,
+				    const struct ksu_sepolicy_stats *s)
+{
+	sepol_dump_printf(
+		d,
+		"# %s: %u rules, %u failed, +%u avtab nodes, +%u xperm nodes, +%u types, +%llu bytes\n",
+		name, rules, failed, s->avtab_nodes, s->xperm_nodes, s->types,
+		(unsigned long long)s->len);
+}
+
+// must hold ksu_sepolicy_lock
+static void sepol_dump(struct sepol_dump *d)
+{
+	struct ksu_sepolicy_stats total = {};
+	struct sepol_rule rule;
+	u32 i, j, rules = 0, failed = 0;
+
+	for (i = 0; i < sepol_source_count; i++) {
+		const struct sepol_source *src = &sepol_sources[i];
+
+		sepol_dump_source_stats(d, src->name, src->rules, src->failed,
+					&src->added);
+		rules += src->rules;
+		failed += src->failed;
+		total.avtab_nodes += src->added.avtab_nodes;
+		total.xperm_nodes += src->added.xperm_nodes;
+		total.types += src->added.types;
+		total.len += src->added.len;
+	}
+	sepol_dump_source_stats(d, "total", rules, failed, &total);
+
+	sepol_dump_printf(d, "\n# builtin\n");
+	sepol_dump_builtin(d);
+
+	for (i = SEPOL_SOURCE_BUILTIN + 1; i < sepol_source_count; i++) {
+		bool header = false;
+
+		for (j = 0; j < journal_count; j++) {
+			if (!journal[j].cmd || journal[j].source != i) {
+				continue;
 			}
-			real_object = object;
-		}
-
-		bool success = ksu_type_transition(db, src, tgt, cls,
-						   default_type, real_object);
-		if (success)
-			ret = 0;
-
-	} else if (cmd == CMD_TYPE_CHANGE) {
-		char src[MAX_SEPOL_LEN];
-		char tgt[MAX_SEPOL_LEN];
-		char cls[MAX_SEPOL_LEN];
-		char default_type[MAX_SEPOL_LEN];
-
-		if (strncpy_from_user(src, data.sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(tgt, data.sepol2, sizeof(tgt)) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(cls, data.sepol3, sizeof(cls)) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(default_type, data.sepol4,
-				      sizeof(default_type)) < 0) {
-			pr_err("sepol: copy default_type failed.\n");
-			goto exit;
-		}
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_type_change(db, src, tgt, cls,
-						  default_type);
-		} else if (subcmd == 2) {
-			success = ksu_type_member(db, src, tgt, cls,
-						  default_type);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		if (success)
-			ret = 0;
-	} else if (cmd == CMD_GENFSCON) {
-		char name[MAX_SEPOL_LEN];
-		char path[MAX_SEPOL_LEN];
-		char context[MAX_SEPOL_LEN];
-		if (strncpy_from_user(name, data.sepol1, sizeof(name)) < 0) {
-			pr_err("sepol: copy name failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(path, data.sepol2, sizeof(path)) < 0) {
-			pr_err("sepol: copy path failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(context, data.sepol3, sizeof(context)) <
-		    0) {
-			pr_err("sepol: copy context failed.\n");
-			goto exit;
+			if (!header) {
+				sepol_dump_printf(d, "\n# %s\n",
+						  sepol_sources[i].name);
+				header = true;
+			}
+			sepol_journal_rule(&journal[j], &rule);
+			sepol_dump_rule(d, &rule);
 		}
+	}
+}
+
+// the dump is truncated beyond this
+#define SEPOL_DUMP_MAX (4 * 1024 * 1024)
+
+int handle_sepolicy_dump(char __user *buf, u32 __user *size)
+{
+	struct sepol_dump d = {};
+	u32 user_size;
+	int ret = 0;
 
-		if (!ksu_genfscon(db, name, path, context)) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
+	if (get_user(user_size, size)) {
+		pr_err("sepol: copy dump size failed.\n");
+		return -EFAULT;
+	}
+
+	d.cap = min_t(u32, user_size, SEPOL_DUMP_MAX);
+	if (buf && d.cap) {
+		d.buf = vmalloc(d.cap);
+		if (!d.buf) {
+			return -ENOMEM;
 		}
-		ret = 0;
 	} else {
-		pr_err("sepol: unknown cmd: %d\n", cmd);
+		d.cap = 0;
 	}
 
-exit:
-	rcu_read_unlock();
+	sepol_lock();
+	sepol_dump(&d);
+	mutex_unlock(&ksu_sepolicy_lock);
 
-	// only allow and xallow needs to reset avc cache, but we cannot do that because
-	// we are in atomic context. so we just reset it every time.
-	reset_avc_cache();
+	// one more byte for the terminating NUL written by vsnprintf
+	if (put_user((u32)min_t(size_t, d.len + 1, U32_MAX), size)) {
+		pr_err("sepol: copy dump size failed.\n");
+		ret = -EFAULT;
+		goto out;
+	}
+	if (d.cap && copy_to_user(buf, d.buf, min(d.len + 1, d.cap))) {
+		pr_err("sepol: copy dump failed.\n");
+		ret = -EFAULT;
+	}
 
+out:
+	vfree(d.buf);
 	return ret;
 }
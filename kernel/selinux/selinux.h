@@ -14,8 +14,16 @@ bool is_ksu_domain();
 
 bool is_zygote(void *cred);
 
+// queue the built-in rules, safe to call from atomic context
 void apply_kernelsu_rules();
 
+void ksu_sepolicy_init(void);
+
+void ksu_sepolicy_exit(void);
+
+// replay our rules if a new policy was loaded since they were applied
+void ksu_sepolicy_check_reload(void);
+
 u32 ksu_get_devpts_sid();
 
 #endif
@@ -45,6 +45,8 @@ static bool add_genfscon(struct policydb *db, const char *fs_name,
 
 static bool add_type(struct policydb *db, const char *type_name, bool attr);
 
+static struct type_datum *get_all_types_attr(struct policydb *db);
+
 static bool set_type_state(struct policydb *db, const char *type_name,
 			   bool permissive);
 
@@ -85,33 +87,54 @@ static bool add_typeattribute(struct policydb *db, const char *type,
 #endif
 
 #define avtab_for_each(avtab, cur)                                             \
-	ksu_hash_for_each(avtab.htable, avtab.nslot, cur);
+	ksu_hash_for_each(avtab.htable, avtab.nslot, cur)
 
-static struct avtab_node *get_avtab_node(struct policydb *db,
-					 struct avtab_key *key,
-					 struct avtab_extended_perms *xperms)
+// Synthetic attribute holding every type, a wildcard source or target is
+// expressed through it with a single avtab node per rule instead of one node
+// per attribute.
+#define KSU_ALL_TYPES "ksu_all_types"
+
+// bumped whenever an operation actually modifies the policy, so callers can
+// tell a new rule from one that was already present
+static u32 policy_generation;
+
+static inline void mark_policy_changed(void)
+{
+	policy_generation++;
+}
+
+// what our patching added to the policy so far
+static struct ksu_sepolicy_stats policy_stats;
+
+static struct avtab_node *find_avtab_node(struct policydb *db,
+					  struct avtab_key *key,
+					  struct avtab_extended_perms *xperms)
 {
 	struct avtab_node *node;
 
 	/* AVTAB_XPERMS entries are not necessarily unique */
 	if (key->specified & AVTAB_XPERMS) {
-		bool match = false;
 		node = avtab_search_node(&db->te_avtab, key);
 		while (node) {
 			if ((node->datum.u.xperms->specified ==
 			     xperms->specified) &&
 			    (node->datum.u.xperms->driver == xperms->driver)) {
-				match = true;
-				break;
+				return node;
 			}
 			node = avtab_search_node_next(node, key->specified);
 		}
-		if (!match)
-			node = NULL;
-	} else {
-		node = avtab_search_node(&db->te_avtab, key);
+		return NULL;
 	}
 
+	return avtab_search_node(&db->te_avtab, key);
+}
+
+static struct avtab_node *get_avtab_node(struct policydb *db,
+					 struct avtab_key *key,
+					 struct avtab_extended_perms *xperms)
+{
+	struct avtab_node *node = find_avtab_node(db, key, xperms);
+
 	if (!node) {
 		struct avtab_datum avdatum = {};
 		/*
@@ -136,6 +159,12 @@ static struct avtab_node *get_avtab_node(struct policydb *db,
 				     ARRAY_SIZE(avdatum.u.xperms->perms.p);
 		}
 		db->len += grow_size;
+		if (key->specified & AVTAB_XPERMS)
+			policy_stats.xperm_nodes++;
+		else
+			policy_stats.avtab_nodes++;
+		policy_stats.len += grow_size;
+		mark_policy_changed();
 	}
 
 	return node;
@@ -179,10 +208,7 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 			return false;
 		}
 
-		perm = symtab_search(&cls->permissions, p);
-		if (perm == NULL && cls->comdatum != NULL) {
-			perm = symtab_search(&cls->comdatum->permissions, p);
-		}
+		perm = ksu_find_perm(cls, p);
 		if (perm == NULL) {
 			pr_info("perm %s does not exist in class %s\n", p, c);
 			return false;
@@ -192,50 +218,53 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 	return true;
 }
 
+// Removals can't be expressed through an attribute, other attributes may still
+// grant the permission. Walk the existing nodes instead: a missing node has
+// nothing to strip, so this never grows the avtab.
+static void strip_rule_wildcard(struct policydb *db, struct type_datum *src,
+				struct type_datum *tgt, struct class_datum *cls,
+				struct perm_datum *perm, int effect, bool invert)
+{
+	u32 bits = perm ? 1U << (perm->value - 1) : ~0U;
+	struct avtab_node *node;
+
+	avtab_for_each(db->te_avtab, node)
+	{
+		struct avtab_key *k = &node->key;
+		if ((k->specified & ~AVTAB_ENABLED) != effect)
+			continue;
+		if ((src && k->source_type != src->value) ||
+		    (tgt && k->target_type != tgt->value) ||
+		    (cls && k->target_class != cls->value))
+			continue;
+
+		u32 cur = node->datum.u.data;
+		u32 data = invert ? cur & ~bits : cur | bits;
+		if (data != cur) {
+			node->datum.u.data = data;
+			mark_policy_changed();
+		}
+	}
+}
+
 static void add_rule_raw(struct policydb *db, struct type_datum *src,
 			 struct type_datum *tgt, struct class_datum *cls,
 			 struct perm_datum *perm, int effect, bool invert)
 {
-	if (src == NULL) {
-		struct hashtab_node *node;
+	if (src == NULL || tgt == NULL) {
 		if (strip_av(effect, invert)) {
-			ksu_hashtab_for_each(db->p_types.table, node)
-			{
-				add_rule_raw(db,
-					     (struct type_datum *)node->datum,
-					     tgt, cls, perm, effect, invert);
-			};
-		} else {
-			ksu_hashtab_for_each(db->p_types.table, node)
-			{
-				struct type_datum *type =
-					(struct type_datum *)(node->datum);
-				if (type->attribute) {
-					add_rule_raw(db, type, tgt, cls, perm,
-						     effect, invert);
-				}
-			};
+			strip_rule_wildcard(db, src, tgt, cls, perm, effect,
+					    invert);
+			return;
 		}
-	} else if (tgt == NULL) {
-		struct hashtab_node *node;
-		if (strip_av(effect, invert)) {
-			ksu_hashtab_for_each(db->p_types.table, node)
-			{
-				add_rule_raw(db, src,
-					     (struct type_datum *)node->datum,
-					     cls, perm, effect, invert);
-			};
-		} else {
-			ksu_hashtab_for_each(db->p_types.table, node)
-			{
-				struct type_datum *type =
-					(struct type_datum *)(node->datum);
-				if (type->attribute) {
-					add_rule_raw(db, src, type, cls, perm,
-						     effect, invert);
-				}
-			};
+
+		struct type_datum *all = get_all_types_attr(db);
+		if (!all) {
+			pr_err("add_rule_raw: no %s attribute\n", KSU_ALL_TYPES);
+			return;
 		}
+		add_rule_raw(db, src ? src : all, tgt ? tgt : all, cls, perm,
+			     effect, invert);
 	} else if (cls == NULL) {
 		struct hashtab_node *node;
 		ksu_hashtab_for_each(db->p_classes.table, node)
@@ -251,19 +280,23 @@ static void add_rule_raw(struct policydb *db, struct type_datum *src,
 		key.target_class = cls->value;
 		key.specified = effect;
 
-		struct avtab_node *node = get_avtab_node(db, &key, NULL);
-		if (invert) {
-			if (perm)
-				node->datum.u.data &=
-					~(1U << (perm->value - 1));
-			else
-				node->datum.u.data = 0U;
-		} else {
-			if (perm)
-				node->datum.u.data |= 1U << (perm->value - 1);
-			else
-				node->datum.u.data = ~0U;
+		// a missing node behaves like its initial value, see get_avtab_node
+		struct avtab_node *node = find_avtab_node(db, &key, NULL);
+		u32 initial = effect == AVTAB_AUDITDENY ? ~0U : 0U;
+		u32 cur = node ? node->datum.u.data : initial;
+		u32 bits = perm ? 1U << (perm->value - 1) : ~0U;
+		u32 data = invert ? cur & ~bits : cur | bits;
+
+		// already in effect, don't grow the avtab for nothing
+		if (data == cur) {
+			return;
 		}
+
+		if (!node) {
+			node = get_avtab_node(db, &key, NULL);
+		}
+		node->datum.u.data = data;
+		mark_policy_changed();
 	}
 }
 
@@ -279,28 +312,15 @@ static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src,
 			       uint16_t low, uint16_t high, int effect,
 			       bool invert)
 {
-	if (src == NULL) {
-		struct hashtab_node *node;
-		ksu_hashtab_for_each(db->p_types.table, node)
-		{
-			struct type_datum *type =
-				(struct type_datum *)(node->datum);
-			if (type->attribute) {
-				add_xperm_rule_raw(db, type, tgt, cls, low,
-						   high, effect, invert);
-			}
-		};
-	} else if (tgt == NULL) {
-		struct hashtab_node *node;
-		ksu_hashtab_for_each(db->p_types.table, node)
-		{
-			struct type_datum *type =
-				(struct type_datum *)(node->datum);
-			if (type->attribute) {
-				add_xperm_rule_raw(db, src, type, cls, low,
-						   high, effect, invert);
-			}
-		};
+	if (src == NULL || tgt == NULL) {
+		struct type_datum *all = get_all_types_attr(db);
+		if (!all) {
+			pr_err("add_xperm_rule_raw: no %s attribute\n",
+			       KSU_ALL_TYPES);
+			return;
+		}
+		add_xperm_rule_raw(db, src ? src : all, tgt ? tgt : all, cls,
+				   low, high, effect, invert);
 	} else if (cls == NULL) {
 		struct hashtab_node *node;
 		ksu_hashtab_for_each(db->p_classes.table, node)
@@ -346,6 +366,25 @@ static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src,
 			}
 		}
 
+		node = find_avtab_node(db, &key, &xperms);
+		if (node && !invert) {
+			// merge into the existing node of this driver
+			struct avtab_extended_perms *cur =
+				node->datum.u.xperms;
+			bool changed = false;
+			for (i = 0; i < ARRAY_SIZE(cur->perms.p); ++i) {
+				u32 missing =
+					xperms.perms.p[i] & ~cur->perms.p[i];
+				if (missing) {
+					cur->perms.p[i] |= missing;
+					changed = true;
+				}
+			}
+			if (changed)
+				mark_policy_changed();
+			return;
+		}
+
 		node = get_avtab_node(db, &key, &xperms);
 		if (!node) {
 			pr_warn("add_xperm_rule_raw cannot found node!\n");
@@ -448,8 +487,14 @@ static bool add_type_rule(struct policydb *db, const char *s, const char *t,
 	key.target_class = cls->value;
 	key.specified = effect;
 
-	struct avtab_node *node = get_avtab_node(db, &key, NULL);
+	struct avtab_node *node = find_avtab_node(db, &key, NULL);
+	if (node && node->datum.u.data == def->value) {
+		return true;
+	}
+
+	node = get_avtab_node(db, &key, NULL);
 	node->datum.u.data = def->value;
+	mark_policy_changed();
 
 	return true;
 }
@@ -536,7 +581,10 @@ static bool add_filename_trans(struct policydb *db, const char *s,
 	while (trans) {
 		if (ebitmap_get_bit(&trans->stypes, src->value - 1)) {
 			// Duplicate, overwrite existing data and return
-			trans->otype = def->value;
+			if (trans->otype != def->value) {
+				trans->otype = def->value;
+				mark_policy_changed();
+			}
 			return true;
 		}
 		if (trans->otype == def->value)
@@ -560,6 +608,7 @@ static bool add_filename_trans(struct policydb *db, const char *s,
 	}
 
 	db->compat_filename_trans_count++;
+	mark_policy_changed();
 	return ebitmap_set_bit(&trans->stypes, src->value - 1, 1) == 0;
 }
 
@@ -585,83 +634,165 @@ static void *ksu_realloc(void *old, size_t new_size, size_t old_size)
 	return new;
 }
 
-static bool add_type(struct policydb *db, const char *type_name, bool attr)
+// Create several types and attributes at once: the value indexed policydb
+// arrays are grown a single time and every role bitmap is updated in one
+// sweep, instead of a copy of all three arrays per new type. Names which
+// already exist are skipped. Returns the number of types created, or a
+// negative errno if the arrays could not be grown.
+static int add_types_bulk(struct policydb *db, const char *const *names,
+			  const bool *attrs, bool *created, u32 count)
 {
-	struct type_datum *type = symtab_search(&db->p_types, type_name);
-	if (type) {
-		pr_warn("Type %s already exists\n", type_name);
-		return true;
-	}
+	u32 i, value, grow = 0;
+	int added = 0;
 
-	u32 value = ++db->p_types.nprim;
-	type = (struct type_datum *)kzalloc(sizeof(struct type_datum),
-					    GFP_ATOMIC);
-	if (!type) {
-		pr_err("add_type: alloc type_datum failed.\n");
-		return false;
+	for (i = 0; i < count; i++) {
+		if (created) {
+			created[i] = false;
+		}
+		if (!symtab_search(&db->p_types, names[i])) {
+			grow++;
+		}
 	}
-
-	type->primary = 1;
-	type->value = value;
-	type->attribute = attr;
-
-	char *key = kstrdup(type_name, GFP_ATOMIC);
-	if (!key) {
-		pr_err("add_type: alloc key failed.\n");
-		return false;
+	if (!grow) {
+		return 0;
 	}
 
-	if (symtab_insert(&db->p_types, key, type)) {
-		pr_err("add_type: insert symtab failed.\n");
-		return false;
-	}
+	u32 old = db->p_types.nprim;
+	u32 size = old + grow;
 
 	struct ebitmap *new_type_attr_map_array =
 		ksu_realloc(db->type_attr_map_array,
-			    value * sizeof(struct ebitmap),
-			    (value - 1) * sizeof(struct ebitmap));
-
+			    size * sizeof(struct ebitmap),
+			    old * sizeof(struct ebitmap));
 	if (!new_type_attr_map_array) {
 		pr_err("add_type: alloc type_attr_map_array failed\n");
-		return false;
+		return -ENOMEM;
 	}
 
 	struct type_datum **new_type_val_to_struct =
 		ksu_realloc(db->type_val_to_struct,
-			    sizeof(*db->type_val_to_struct) * value,
-			    sizeof(*db->type_val_to_struct) * (value - 1));
-
+			    sizeof(*db->type_val_to_struct) * size,
+			    sizeof(*db->type_val_to_struct) * old);
 	if (!new_type_val_to_struct) {
 		pr_err("add_type: alloc type_val_to_struct failed\n");
-		return false;
+		return -ENOMEM;
 	}
 
 	char **new_val_to_name_types =
 		ksu_realloc(db->sym_val_to_name[SYM_TYPES],
-			    sizeof(char *) * value,
-			    sizeof(char *) * (value - 1));
+			    sizeof(char *) * size, sizeof(char *) * old);
 	if (!new_val_to_name_types) {
 		pr_err("add_type: alloc val_to_name failed\n");
-		return false;
+		return -ENOMEM;
 	}
 
 	db->type_attr_map_array = new_type_attr_map_array;
-	ebitmap_init(&db->type_attr_map_array[value - 1]);
-	ebitmap_set_bit(&db->type_attr_map_array[value - 1], value - 1, 1);
-
 	db->type_val_to_struct = new_type_val_to_struct;
-	db->type_val_to_struct[value - 1] = type;
-
 	db->sym_val_to_name[SYM_TYPES] = new_val_to_name_types;
-	db->sym_val_to_name[SYM_TYPES][value - 1] = key;
 
-	int i;
-	for (i = 0; i < db->p_roles.nprim; ++i) {
-		ebitmap_set_bit(&db->role_val_to_struct[i]->types, value - 1,
+	// keep wildcard rules covering types created after them
+	struct type_datum *all = symtab_search(&db->p_types, KSU_ALL_TYPES);
+
+	for (i = 0; i < count && db->p_types.nprim < size; i++) {
+		// also catches names listed twice
+		if (symtab_search(&db->p_types, names[i])) {
+			continue;
+		}
+
+		value = db->p_types.nprim + 1;
+		struct type_datum *type = (struct type_datum *)kzalloc(
+			sizeof(struct type_datum), GFP_ATOMIC);
+		if (!type) {
+			pr_err("add_type: alloc type_datum failed.\n");
+			added = -ENOMEM;
+			break;
+		}
+
+		type->primary = 1;
+		type->value = value;
+		type->attribute = attrs[i];
+
+		char *key = kstrdup(names[i], GFP_ATOMIC);
+		if (!key) {
+			pr_err("add_type: alloc key failed.\n");
+			added = -ENOMEM;
+			break;
+		}
+
+		if (symtab_insert(&db->p_types, key, type)) {
+			pr_err("add_type: insert symtab failed.\n");
+			added = -ENOMEM;
+			break;
+		}
+		db->p_types.nprim = value;
+
+		ebitmap_init(&db->type_attr_map_array[value - 1]);
+		ebitmap_set_bit(&db->type_attr_map_array[value - 1], value - 1,
 				1);
+		if (all && !attrs[i]) {
+			ebitmap_set_bit(&db->type_attr_map_array[value - 1],
+					all->value - 1, 1);
+		}
+		db->type_val_to_struct[value - 1] = type;
+		db->sym_val_to_name[SYM_TYPES][value - 1] = key;
+
+		if (created) {
+			created[i] = true;
+		}
+		added++;
 	}
 
-	return true;
+	// roles are the outer loop, each bitmap is only walked once
+	for (i = 0; i < db->p_roles.nprim; ++i) {
+		for (value = old + 1; value <= db->p_types.nprim; ++value) {
+			ebitmap_set_bit(&db->role_val_to_struct[i]->types,
+					value - 1, 1);
+		}
+	}
+
+	if (db->p_types.nprim != old) {
+		policy_stats.types += db->p_types.nprim - old;
+		mark_policy_changed();
+	}
+	return added;
+}
+
+static bool add_type(struct policydb *db, const char *type_name, bool attr)
+{
+	if (symtab_search(&db->p_types, type_name)) {
+		pr_warn("Type %s already exists\n", type_name);
+		return true;
+	}
+
+	return add_types_bulk(db, &type_name, &attr, NULL, 1) == 1;
+}
+
+static struct type_datum *get_all_types_attr(struct policydb *db)
+{
+	struct type_datum *all = symtab_search(&db->p_types, KSU_ALL_TYPES);
+	if (all) {
+		return all;
+	}
+
+	if (!add_type(db, KSU_ALL_TYPES, true)) {
+		return NULL;
+	}
+	all = symtab_search(&db->p_types, KSU_ALL_TYPES);
+	if (!all) {
+		return NULL;
+	}
+
+	u32 value;
+	for (value = 1; value < all->value; ++value) {
+		struct type_datum *type = db->type_val_to_struct[value - 1];
+		if (type && !type->attribute) {
+			ebitmap_set_bit(&db->type_attr_map_array[value - 1],
+					all->value - 1, 1);
+		}
+	}
+
+	pr_info("%s attribute created for wildcard rules\n", KSU_ALL_TYPES);
+	return all;
 }
 
 static bool set_type_state(struct policydb *db, const char *type_name,
@@ -673,9 +804,14 @@ static bool set_type_state(struct policydb *db, const char *type_name,
 		ksu_hashtab_for_each(db->p_types.table, node)
 		{
 			type = (struct type_datum *)(node->datum);
+			if (ebitmap_get_bit(&db->permissive_map, type->value) ==
+			    permissive)
+				continue;
 			if (ebitmap_set_bit(&db->permissive_map, type->value,
 					    permissive))
 				pr_info("Could not set bit in permissive map\n");
+			else
+				mark_policy_changed();
 		};
 	} else {
 		type = (struct type_datum *)symtab_search(&db->p_types,
@@ -684,11 +820,15 @@ static bool set_type_state(struct policydb *db, const char *type_name,
 			pr_info("type %s does not exist\n", type_name);
 			return false;
 		}
+		if (ebitmap_get_bit(&db->permissive_map, type->value) ==
+		    permissive)
+			return true;
 		if (ebitmap_set_bit(&db->permissive_map, type->value,
 				    permissive)) {
 			pr_info("Could not set bit in permissive map\n");
 			return false;
 		}
+		mark_policy_changed();
 	}
 	return true;
 }
@@ -697,7 +837,10 @@ static void add_typeattribute_raw(struct policydb *db, struct type_datum *type,
 				  struct type_datum *attr)
 {
 	struct ebitmap *sattr = &db->type_attr_map_array[type->value - 1];
+	if (ebitmap_get_bit(sattr, attr->value - 1))
+		return;
 	ebitmap_set_bit(sattr, attr->value - 1, 1);
+	mark_policy_changed();
 
 	struct hashtab_node *node;
 	struct constraint_node *n;
@@ -756,6 +899,12 @@ bool ksu_attribute(struct policydb *db, const char *name)
 	return add_type(db, name, true);
 }
 
+int ksu_add_types(struct policydb *db, const char *const *names,
+		  const bool *attrs, bool *created, u32 count)
+{
+	return add_types_bulk(db, names, attrs, created, count);
+}
+
 bool ksu_permissive(struct policydb *db, const char *type)
 {
 	return set_type_state(db, type, true);
@@ -776,6 +925,55 @@ bool ksu_exists(struct policydb *db, const char *type)
 	return symtab_search(&db->p_types, type) != NULL;
 }
 
+struct type_datum *ksu_find_type(struct policydb *db, const char *name)
+{
+	return symtab_search(&db->p_types, name);
+}
+
+struct class_datum *ksu_find_class(struct policydb *db, const char *name)
+{
+	return symtab_search(&db->p_classes, name);
+}
+
+struct perm_datum *ksu_find_perm(struct class_datum *cls, const char *name)
+{
+	struct perm_datum *perm = symtab_search(&cls->permissions, name);
+	if (perm == NULL && cls->comdatum != NULL) {
+		perm = symtab_search(&cls->comdatum->permissions, name);
+	}
+	return perm;
+}
+
+void ksu_allow_raw(struct policydb *db, struct type_datum *src,
+		   struct type_datum *tgt, struct class_datum *cls,
+		   struct perm_datum *perm)
+{
+	add_rule_raw(db, src, tgt, cls, perm, AVTAB_ALLOWED, false);
+}
+
+void ksu_allowxperm_raw(struct policydb *db, struct type_datum *src,
+			struct type_datum *tgt, struct class_datum *cls)
+{
+	add_xperm_rule_raw(db, src, tgt, cls, 0, 0xFFFF, AVTAB_XPERMS_ALLOWED,
+			   false);
+}
+
+void ksu_get_sepolicy_stats(struct ksu_sepolicy_stats *stats)
+{
+	*stats = policy_stats;
+}
+
+u32 ksu_policy_generation(void)
+{
+	return policy_generation;
+}
+
+u32 ksu_type_value(struct policydb *db, const char *type)
+{
+	struct type_datum *datum = symtab_search(&db->p_types, type);
+	return datum ? datum->value : 0;
+}
+
 // Access vector rules
 bool ksu_allow(struct policydb *db, const char *src, const char *tgt,
 	       const char *cls, const char *perm)
@@ -8,10 +8,28 @@
 // Operation on types
 bool ksu_type(struct policydb *db, const char *name, const char *attr);
 bool ksu_attribute(struct policydb *db, const char *name);
+// create many types (attrs[i] false) and attributes at once, created[i] is
+// set for names that did not exist yet and may be NULL
+int ksu_add_types(struct policydb *db, const char *const *names,
+		  const bool *attrs, bool *created, u32 count);
 bool ksu_permissive(struct policydb *db, const char *type);
 bool ksu_enforce(struct policydb *db, const char *type);
 bool ksu_typeattribute(struct policydb *db, const char *type, const char *attr);
 bool ksu_exists(struct policydb *db, const char *type);
+// running totals of the policy growth caused by the operations below
+struct ksu_sepolicy_stats {
+	u32 avtab_nodes;
+	u32 xperm_nodes;
+	u32 types;
+	u64 len; // growth of db->len in bytes
+};
+void ksu_get_sepolicy_stats(struct ksu_sepolicy_stats *stats);
+
+// changes whenever an operation modifies the policy, a rule whose apply
+// leaves it untouched was already present
+u32 ksu_policy_generation(void);
+// value of a type or attribute, 0 if it does not exist
+u32 ksu_type_value(struct policydb *db, const char *type);
 
 // Access vector rules
 bool ksu_allow(struct policydb *db, const char *src, const char *tgt,
@@ -39,6 +57,17 @@ bool ksu_type_change(struct policydb *db, const char *src, const char *tgt,
 bool ksu_type_member(struct policydb *db, const char *src, const char *tgt,
 		     const char *cls, const char *def);
 
+// Pre-resolved rules, for rule sets that look up each name only once. NULL
+// datums stand for ALL like the string based interface above.
+struct type_datum *ksu_find_type(struct policydb *db, const char *name);
+struct class_datum *ksu_find_class(struct policydb *db, const char *name);
+struct perm_datum *ksu_find_perm(struct class_datum *cls, const char *name);
+void ksu_allow_raw(struct policydb *db, struct type_datum *src,
+		   struct type_datum *tgt, struct class_datum *cls,
+		   struct perm_datum *perm);
+void ksu_allowxperm_raw(struct policydb *db, struct type_datum *src,
+			struct type_datum *tgt, struct class_datum *cls);
+
 // File system labeling
 bool ksu_genfscon(struct policydb *db, const char *fs_name, const char *path,
 		  const char *ctx);
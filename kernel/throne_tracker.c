@@ -1,12 +1,21 @@
+#include <linux/bitmap.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "allowlist.h"
+#include "apk_sign.h"
+#include "file_parser.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksu.h"
 #include "manager.h"
@@ -15,14 +24,66 @@
 
 uid_t ksu_manager_uid = KSU_INVALID_UID;
 
-#define SYSTEM_PACKAGES_LIST_PATH "/data/system/packages.list.tmp"
+// track_throne() runs deferred, after the rename of packages.list.tmp has completed
+#define SYSTEM_PACKAGES_LIST_PATH "/data/system/packages.list"
+#define THRONE_COALESCE_MS 500
 
+#define PACKAGES_TABLE_BITS 10
+#define PACKAGES_READ_CHUNK 4096
+
+// One line of packages.list, kept resident between renames so that every
+// update only costs work proportional to what actually changed.
 struct uid_data {
-	struct list_head list;
+	struct hlist_node node;
 	u32 uid;
+	u32 line_hash;
+	u32 generation;
 	char package[KSU_MAX_PACKAGE_NAME];
 };
 
+struct packages_diff {
+	int added;
+	int changed;
+	int removed;
+	bool manager_touched;
+};
+
+static DEFINE_HASHTABLE(packages_table, PACKAGES_TABLE_BITS);
+static DEFINE_MUTEX(throne_mutex);
+static u32 packages_generation;
+static bool packages_loaded;
+
+#define FIRST_APPLICATION_APPID 10000
+#define LAST_APPLICATION_APPID 19999
+
+// app ids of the table, readable without throne_mutex so that prctl can
+// tell whether a pending scan may concern its caller
+static DECLARE_BITMAP(listed_appids,
+		      LAST_APPLICATION_APPID - FIRST_APPLICATION_APPID + 1);
+
+static inline u32 package_key(const char *package)
+{
+	return full_name_hash(NULL, package, strlen(package));
+}
+
+static struct uid_data *find_package(const char *package, u32 uid)
+{
+	struct uid_data *np;
+
+	hash_for_each_possible (packages_table, np, node, package_key(package)) {
+		if ((uid == KSU_INVALID_UID || np->uid == uid) &&
+		    strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0)
+			return np;
+	}
+	return NULL;
+}
+
+static inline bool is_manager_appid(u32 uid)
+{
+	return ksu_is_manager_uid_valid() &&
+	       uid == ksu_get_manager_uid() % 100000;
+}
+
 static int get_pkg_from_apk_path(char *pkg, const char *path)
 {
 	int len = strlen(path);
@@ -62,7 +123,7 @@ static int get_pkg_from_apk_path(char *pkg, const char *path)
 	return 0;
 }
 
-static void crown_manager(const char *apk, struct list_head *uid_data)
+static void crown_manager(const char *apk)
 {
 	char pkg[KSU_MAX_PACKAGE_NAME];
 	if (get_pkg_from_apk_path(pkg, apk) < 0) {
@@ -80,15 +141,10 @@ static void crown_manager(const char *apk, struct list_head *uid_data)
 		return;
 	}
 #endif
-	struct list_head *list = (struct list_head *)uid_data;
-	struct uid_data *np;
-
-	list_for_each_entry (np, list, list) {
-		if (strncmp(np->package, pkg, KSU_MAX_PACKAGE_NAME) == 0) {
-			pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
-			ksu_set_manager_uid(np->uid);
-			break;
-		}
+	struct uid_data *np = find_package(pkg, KSU_INVALID_UID);
+	if (np) {
+		pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
+		ksu_set_manager_uid(np->uid);
 	}
 }
 
@@ -100,21 +156,68 @@ struct data_path {
 	struct list_head list;
 };
 
-struct apk_path_hash {
-	unsigned int hash;
-	bool exists;
-	struct list_head list;
+// base.apk verification is fanned out to an unbound workqueue, the first
+// job that finds the manager stops both the crawl and the pending jobs.
+static struct workqueue_struct *apk_verify_wq;
+
+struct manager_scan {
+	atomic_t stop;
+	atomic_t checked;
+	char manager_apk[DATA_PATH_LEN];
+};
+
+struct apk_verify_job {
+	struct work_struct work;
+	struct manager_scan *scan;
+	char path[DATA_PATH_LEN];
 };
 
-static struct list_head apk_path_hash_list = LIST_HEAD_INIT(apk_path_hash_list);
+static void do_verify_apk(struct work_struct *work)
+{
+	struct apk_verify_job *job =
+		container_of(work, struct apk_verify_job, work);
+	struct manager_scan *scan = job->scan;
+
+	if (!atomic_read(&scan->stop)) {
+		atomic_inc(&scan->checked);
+		if (is_manager_apk(job->path) &&
+		    !atomic_cmpxchg(&scan->stop, 0, 1)) {
+			pr_info("Found manager base.apk at path: %s\n",
+				job->path);
+			strscpy(scan->manager_apk, job->path, DATA_PATH_LEN);
+		}
+	}
+
+	kfree(job);
+}
+
+static void queue_verify_apk(struct manager_scan *scan, const char *path)
+{
+	struct apk_verify_job *job = kmalloc(sizeof(*job), GFP_KERNEL);
+
+	if (!job || !apk_verify_wq) {
+		kfree(job);
+		// fallback to verify it inline
+		atomic_inc(&scan->checked);
+		if (is_manager_apk((char *)path) &&
+		    !atomic_cmpxchg(&scan->stop, 0, 1))
+			strscpy(scan->manager_apk, path, DATA_PATH_LEN);
+		return;
+	}
+
+	INIT_WORK(&job->work, do_verify_apk);
+	job->scan = scan;
+	strscpy(job->path, path, DATA_PATH_LEN);
+	queue_work(apk_verify_wq, &job->work);
+}
 
 struct my_dir_context {
 	struct dir_context ctx;
 	struct list_head *data_path_list;
 	char *parent_dir;
-	void *private_data;
+	const char *package; // only descend into this package's dirs if set
 	int depth;
-	int *stop;
+	struct manager_scan *scan;
 };
 // https://docs.kernel.org/filesystems/porting.html
 // filldir_t (readdir callbacks) calling conventions have changed. Instead of returning 0 or -E... it returns bool now. false means "no more" (as -E... used to) and true - "keep going" (as 0 in old calling conventions). Rationale: callers never looked at specific -E... values anyway. -> iterate_shared() instances require no changes at all, all filldir_t ones in the tree converted.
@@ -128,6 +231,17 @@ struct my_dir_context {
 #define FILLDIR_ACTOR_STOP -EINVAL
 #endif
 
+// /data/app/~~<random>==/<package>-<random>== on Android 11+,
+// /data/app/<package>-<random> before that
+static bool is_package_dir(const char *name, int namelen, const char *package)
+{
+	size_t len = strlen(package);
+
+	if (namelen >= 2 && name[0] == '~' && name[1] == '~')
+		return true;
+	return namelen > len && name[len] == '-' && !strncmp(name, package, len);
+}
+
 FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
 			     int namelen, loff_t off, u64 ino,
 			     unsigned int d_type)
@@ -140,7 +254,7 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
 		pr_err("Invalid context\n");
 		return FILLDIR_ACTOR_STOP;
 	}
-	if (my_ctx->stop && *my_ctx->stop) {
+	if (atomic_read(&my_ctx->scan->stop)) {
 		pr_info("Stop searching\n");
 		return FILLDIR_ACTOR_STOP;
 	}
@@ -155,8 +269,11 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
 		return FILLDIR_ACTOR_CONTINUE;
 	}
 
-	if (d_type == DT_DIR && my_ctx->depth > 0 &&
-	    (my_ctx->stop && !*my_ctx->stop)) {
+	if (d_type == DT_DIR && my_ctx->package &&
+	    !is_package_dir(name, namelen, my_ctx->package))
+		return FILLDIR_ACTOR_CONTINUE;
+
+	if (d_type == DT_DIR && my_ctx->depth > 0) {
 		struct data_path *data = kmalloc(sizeof(struct data_path), GFP_ATOMIC);
 
 		if (!data) {
@@ -168,52 +285,28 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
 		data->depth = my_ctx->depth - 1;
 		list_add_tail(&data->list, my_ctx->data_path_list);
 	} else {
-		if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0)) {
-			struct apk_path_hash *pos, *n;
-			unsigned int hash = full_name_hash(NULL, dirpath, strlen(dirpath));
-			list_for_each_entry(pos, &apk_path_hash_list, list) {
-				if (hash == pos->hash) {
-					pos->exists = true;
-					return FILLDIR_ACTOR_CONTINUE;
-				}
-			}
-
-			bool is_manager = is_manager_apk(dirpath);
-			pr_info("Found new base.apk at path: %s, is_manager: %d\n",
-				dirpath, is_manager);
-			if (is_manager) {
-				crown_manager(dirpath, my_ctx->private_data);
-				*my_ctx->stop = 1;
-
-				// Manager found, clear APK cache list
-				list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
-					list_del(&pos->list);
-					kfree(pos);
-				}
-			} else {
-				struct apk_path_hash *apk_data = kmalloc(sizeof(struct apk_path_hash), GFP_ATOMIC);
-				apk_data->hash = hash;
-				apk_data->exists = true;
-				list_add_tail(&apk_data->list, &apk_path_hash_list);
-			}
-		}
+		if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0))
+			queue_verify_apk(my_ctx->scan, dirpath);
 	}
 
 	return FILLDIR_ACTOR_CONTINUE;
 }
 
-void search_manager(const char *path, int depth, struct list_head *uid_data)
+void search_manager(const char *path, int depth, const char *package)
 {
-	int i, stop = 0;
+	int i;
 	struct list_head data_path_list;
-	INIT_LIST_HEAD(&data_path_list);
+	struct manager_scan *scan;
+	ktime_t start = ktime_get();
 
-	// Initialize APK cache list
-	struct apk_path_hash *pos, *n;
-	list_for_each_entry(pos, &apk_path_hash_list, list) {
-		pos->exists = false;
+	scan = kzalloc(sizeof(*scan), GFP_KERNEL);
+	if (!scan) {
+		pr_err("search_manager: alloc scan failed\n");
+		return;
 	}
 
+	INIT_LIST_HEAD(&data_path_list);
+
 	// First depth
 	struct data_path data;
 	strscpy(data.dirpath, path, DATA_PATH_LEN);
@@ -227,12 +320,12 @@ void search_manager(const char *path, int depth, struct list_head *uid_data)
 			struct my_dir_context ctx = { .ctx.actor = my_actor,
 						      .data_path_list = &data_path_list,
 						      .parent_dir = pos->dirpath,
-						      .private_data = uid_data,
+						      .package = package,
 						      .depth = pos->depth,
-						      .stop = &stop };
+						      .scan = scan };
 			struct file *file;
 
-			if (!stop) {
+			if (!atomic_read(&scan->stop)) {
 				file = ksu_filp_open_compat(pos->dirpath, O_RDONLY | O_NOFOLLOW, 0);
 				if (IS_ERR(file)) {
 					pr_err("Failed to open directory: %s, err: %ld\n", pos->dirpath, PTR_ERR(file));
@@ -249,33 +342,174 @@ skip_iterate:
 		}
 	}
 
-	// Remove stale cached APK entries
-	list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
-		if (!pos->exists) {
-			list_del(&pos->list);
-			kfree(pos);
-		}
-	}
+	// jobs queued after the manager is found bail out immediately
+	if (apk_verify_wq)
+		flush_workqueue(apk_verify_wq);
+
+	if (scan->manager_apk[0])
+		crown_manager(scan->manager_apk);
+
+	pr_info("search_manager: checked %d apks in %lld ms\n",
+		atomic_read(&scan->checked),
+		ktime_to_ms(ktime_sub(ktime_get(), start)));
+	kfree(scan);
 }
 
 static bool is_uid_exist(uid_t uid, char *package, void *data)
 {
-	struct list_head *list = (struct list_head *)data;
+	return find_package(package, uid % 100000) != NULL;
+}
+
+static void update_package(char *line, size_t len, struct packages_diff *diff)
+{
+	u32 line_hash = full_name_hash(NULL, line, len);
 	struct uid_data *np;
+	char *package;
+	u32 uid;
+
+	if (ksu_parse_packages_line(line, &package, &uid)) {
+		pr_err("update_uid: malformed line, skip it\n");
+		return;
+	}
+
+	np = find_package(package, uid);
+	if (np) {
+		if (np->generation == packages_generation)
+			return; // duplicated line
+		np->generation = packages_generation;
+		if (np->line_hash != line_hash) {
+			np->line_hash = line_hash;
+			diff->changed++;
+			if (is_manager_appid(np->uid))
+				diff->manager_touched = true;
+		}
+		return;
+	}
+
+	np = kzalloc(sizeof(struct uid_data), GFP_KERNEL);
+	if (!np) {
+		pr_err("update_uid: alloc failed for %s\n", package);
+		return;
+	}
+	np->uid = uid;
+	np->line_hash = line_hash;
+	np->generation = packages_generation;
+	strscpy(np->package, package, KSU_MAX_PACKAGE_NAME);
+	hash_add(packages_table, &np->node, package_key(np->package));
+	diff->added++;
+}
+
+static int read_packages_list(struct file *fp, struct packages_diff *diff)
+{
+	char *buf = kmalloc(PACKAGES_READ_CHUNK, GFP_KERNEL);
+	bool skipping = false;
+	size_t used = 0;
+	loff_t pos = 0;
+	ssize_t count;
+
+	if (!buf)
+		return -ENOMEM;
+
+	for (;;) {
+		char *start = buf, *end, *nl;
 
-	bool exist = false;
-	list_for_each_entry (np, list, list) {
-		if (np->uid == uid % 100000 &&
-		    strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0) {
-			exist = true;
+		count = ksu_kernel_read_compat(fp, buf + used,
+					       PACKAGES_READ_CHUNK - used, &pos);
+		if (count <= 0)
 			break;
+
+		used += count;
+		end = buf + used;
+		while ((nl = memchr(start, '\n', end - start))) {
+			*nl = '\0';
+			if (!skipping)
+				update_package(start, nl - start, diff);
+			skipping = false;
+			start = nl + 1;
+		}
+
+		used = end - start;
+		if (used == PACKAGES_READ_CHUNK) {
+			pr_err("update_uid: line too long, skip it\n");
+			skipping = true;
+			used = 0;
+		} else {
+			memmove(buf, start, used);
 		}
 	}
-	return exist;
+
+	// the last line may come without a trailing newline
+	if (!count && used && !skipping) {
+		buf[used] = '\0';
+		update_package(buf, used, diff);
+	}
+
+	kfree(buf);
+	return count < 0 ? count : 0;
+}
+
+// drop every entry that was not seen in the latest packages.list
+static void sweep_packages(struct packages_diff *diff)
+{
+	struct uid_data *np;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe (packages_table, bkt, tmp, np, node) {
+		if (np->generation == packages_generation)
+			continue;
+		if (is_manager_appid(np->uid))
+			diff->manager_touched = true;
+		hash_del(&np->node);
+		kfree(np);
+		diff->removed++;
+	}
+}
+
+static void update_listed_appids(void)
+{
+	struct uid_data *np;
+	int bkt;
+
+	bitmap_zero(listed_appids,
+		    LAST_APPLICATION_APPID - FIRST_APPLICATION_APPID + 1);
+	hash_for_each (packages_table, bkt, np, node) {
+		u32 appid = np->uid % 100000;
+		if (appid >= FIRST_APPLICATION_APPID &&
+		    appid <= LAST_APPLICATION_APPID)
+			set_bit(appid - FIRST_APPLICATION_APPID,
+				listed_appids);
+	}
+}
+
+// system app ids never come from a fresh install
+static bool is_appid_listed(u32 appid)
+{
+	if (appid < FIRST_APPLICATION_APPID || appid > LAST_APPLICATION_APPID)
+		return true;
+	return test_bit(appid - FIRST_APPLICATION_APPID, listed_appids);
+}
+
+static bool is_manager_listed(void)
+{
+	struct uid_data *np;
+	int bkt;
+
+	hash_for_each (packages_table, bkt, np, node) {
+		// if manager is installed in work profile, the uid in packages.list is still equals main profile
+		// don't delete it in this case!
+		if (is_manager_appid(np->uid))
+			return true;
+	}
+	return false;
 }
 
 void track_throne()
 {
+	struct packages_diff diff = { 0 };
+	bool first_run;
+	int ret;
+
 	struct file *fp =
 		ksu_filp_open_compat(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
 	if (IS_ERR(fp)) {
@@ -284,95 +518,253 @@ void track_throne()
 		return;
 	}
 
-	struct list_head uid_list;
-	INIT_LIST_HEAD(&uid_list);
+	mutex_lock(&throne_mutex);
 
-	char chr = 0;
-	loff_t pos = 0;
-	loff_t line_start = 0;
-	char buf[KSU_MAX_PACKAGE_NAME];
-	for (;;) {
-		ssize_t count =
-			ksu_kernel_read_compat(fp, &chr, sizeof(chr), &pos);
-		if (count != sizeof(chr))
-			break;
-		if (chr != '\n')
-			continue;
+	packages_generation++;
+	ret = read_packages_list(fp, &diff);
+	filp_close(fp, 0);
+	if (ret) {
+		// a partial read must not be mistaken for uninstalled packages
+		pr_err("%s: read packages.list failed: %d\n", __func__, ret);
+		goto out;
+	}
 
-		count = ksu_kernel_read_compat(fp, buf, sizeof(buf),
-					       &line_start);
+	sweep_packages(&diff);
+	update_listed_appids();
+	first_run = !packages_loaded;
+	packages_loaded = true;
+	pr_info("packages.list: %d added, %d changed, %d removed\n",
+		diff.added, diff.changed, diff.removed);
+
+	// first, check if manager is still the one we crowned
+	if (ksu_is_manager_uid_valid() &&
+	    (diff.manager_touched || (first_run && !is_manager_listed()))) {
+		pr_info("manager is uninstalled or changed, invalidate it!\n");
+		ksu_invalidate_manager_uid();
+	}
 
-		struct uid_data *data =
-			kzalloc(sizeof(struct uid_data), GFP_ATOMIC);
-		if (!data) {
-			filp_close(fp, 0);
-			goto out;
-		}
+	if (!ksu_is_manager_uid_valid() &&
+	    (first_run || diff.manager_touched || diff.added || diff.changed)) {
+		pr_info("Searching manager...\n");
+		search_manager("/data/app", 2, NULL);
+		pr_info("Search manager finished\n");
+	}
 
-		char *tmp = buf;
-		const char *delim = " ";
-		char *package = strsep(&tmp, delim);
-		char *uid = strsep(&tmp, delim);
-		if (!uid || !package) {
-			pr_err("update_uid: package or uid is NULL!\n");
-			break;
-		}
+	// then prune the allowlist, only disappeared packages matter
+	if (first_run || diff.removed)
+		ksu_prune_allowlist(is_uid_exist, NULL);
+out:
+	mutex_unlock(&throne_mutex);
+}
+
+struct manager_verify_work {
+	struct work_struct work;
+	const char *package;
+	uid_t uid;
+	bool crowned;
+	u32 generation;
+};
+
+// CMD_BECOME_MANAGER is open to every app and a verification crawls
+// /data/app on the ordered ksu workqueue, so callers are throttled: a
+// package that failed stays rejected until packages.list changes, and a uid
+// gets at most one verification per VERIFY_INTERVAL.
+#define VERIFY_INTERVAL (5 * HZ)
+#define VERIFY_SLOTS 16
+
+struct verify_attempt {
+	uid_t uid;
+	u32 package_hash;
+	u32 failed_generation; // 0: no failure recorded
+	unsigned long last;
+};
+
+static struct verify_attempt verify_attempts[VERIFY_SLOTS];
+static DEFINE_SPINLOCK(verify_attempts_lock);
 
-		u32 res;
-		if (kstrtou32(uid, 10, &res)) {
-			pr_err("update_uid: uid parse err\n");
+// returns false if the attempt has to be rejected without verification
+static bool verify_attempt_begin(uid_t uid, u32 package_hash)
+{
+	struct verify_attempt *slot = NULL;
+	bool allowed = true;
+	int i;
+
+	spin_lock(&verify_attempts_lock);
+	for (i = 0; i < VERIFY_SLOTS; i++) {
+		struct verify_attempt *a = &verify_attempts[i];
+		if (a->last && a->uid == uid) {
+			slot = a;
 			break;
 		}
-		data->uid = res;
-		strncpy(data->package, package, KSU_MAX_PACKAGE_NAME);
-		list_add_tail(&data->list, &uid_list);
-		// reset line start
-		line_start = pos;
+		// reuse the least recently used slot
+		if (!slot || !a->last ||
+		    (slot->last && time_before(a->last, slot->last)))
+			slot = a;
 	}
-	filp_close(fp, 0);
 
-	// now update uid list
-	struct uid_data *np;
-	struct uid_data *n;
+	if (slot->last && slot->uid == uid) {
+		if (slot->failed_generation &&
+		    slot->failed_generation == READ_ONCE(packages_generation) &&
+		    slot->package_hash == package_hash)
+			allowed = false;
+		else if (time_before(jiffies, slot->last + VERIFY_INTERVAL))
+			allowed = false;
+	}
+	if (allowed) {
+		slot->uid = uid;
+		slot->package_hash = package_hash;
+		slot->failed_generation = 0;
+		slot->last = jiffies ? jiffies : 1;
+	}
+	spin_unlock(&verify_attempts_lock);
 
-	// first, check if manager_uid exist!
-	bool manager_exist = false;
-	list_for_each_entry (np, &uid_list, list) {
-		// if manager is installed in work profile, the uid in packages.list is still equals main profile
-		// don't delete it in this case!
-		int manager_uid = ksu_get_manager_uid() % 100000;
-		if (np->uid == manager_uid) {
-			manager_exist = true;
+	return allowed;
+}
+
+static void verify_attempt_failed(uid_t uid, u32 package_hash, u32 generation)
+{
+	int i;
+
+	spin_lock(&verify_attempts_lock);
+	for (i = 0; i < VERIFY_SLOTS; i++) {
+		struct verify_attempt *a = &verify_attempts[i];
+		if (a->last && a->uid == uid &&
+		    a->package_hash == package_hash) {
+			a->failed_generation = generation;
 			break;
 		}
 	}
+	spin_unlock(&verify_attempts_lock);
+}
 
-	if (!manager_exist) {
-		if (ksu_is_manager_uid_valid()) {
-			pr_info("manager is uninstalled, invalidate it!\n");
-			ksu_invalidate_manager_uid();
-		}
-		pr_info("Searching manager...\n");
-		search_manager("/data/app", 2, &uid_list);
-		pr_info("Search manager finished\n");
+static void do_verify_manager(struct work_struct *work)
+{
+	struct manager_verify_work *verify =
+		container_of(work, struct manager_verify_work, work);
+	struct uid_data *np;
+
+	mutex_lock(&throne_mutex);
+	verify->generation = packages_generation;
+	if (ksu_is_manager_uid_valid())
+		goto out;
+
+	// the caller must really own the package it claims
+	np = find_package(verify->package, verify->uid % 100000);
+	if (!np) {
+		pr_info("verify_manager: %s(uid=%d) is not installed\n",
+			verify->package, verify->uid);
+		goto out;
 	}
 
-	// then prune the allowlist
-	ksu_prune_allowlist(is_uid_exist, &uid_list);
+	search_manager("/data/app", 2, verify->package);
+	verify->crowned = ksu_is_manager_uid_valid() &&
+			  ksu_get_manager_uid() == np->uid;
 out:
-	// free uid_list
-	list_for_each_entry_safe (np, n, &uid_list, list) {
-		list_del(&np->list);
-		kfree(np);
-	}
+	mutex_unlock(&throne_mutex);
+}
+
+bool ksu_verify_manager_package(const char *package, uid_t uid)
+{
+	struct manager_verify_work verify = {
+		.package = package,
+		.uid = uid,
+	};
+	u32 package_hash;
+
+	// nothing to crown, or a caller packages.list doesn't know
+	if (ksu_is_manager_uid_valid() || !READ_ONCE(packages_loaded) ||
+	    !is_appid_listed(uid % 100000))
+		return false;
+
+	package_hash = package_key(package);
+	if (!verify_attempt_begin(uid, package_hash))
+		return false;
+
+	// apps can't read /data/app themselves, do it in kernel context
+	INIT_WORK_ONSTACK(&verify.work, do_verify_manager);
+	ksu_queue_work(&verify.work);
+	flush_work(&verify.work);
+	destroy_work_on_stack(&verify.work);
+
+	if (!verify.crowned && verify.generation)
+		verify_attempt_failed(uid, package_hash, verify.generation);
+
+	return verify.crowned;
+}
+
+static atomic_t throne_requested = ATOMIC_INIT(0);
+static atomic_t throne_completed = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(throne_waitq);
+
+static void do_track_throne(struct work_struct *work)
+{
+	int target = atomic_read(&throne_requested);
+
+	track_throne();
+
+	atomic_set(&throne_completed, target);
+	wake_up_all(&throne_waitq);
+}
+
+static DECLARE_DELAYED_WORK(throne_work, do_track_throne);
+
+void ksu_queue_track_throne(void)
+{
+	atomic_inc(&throne_requested);
+	// an already pending run keeps its timer, so a storm of renames
+	// within the window is handled by one scan
+	ksu_queue_delayed_work(&throne_work,
+			       msecs_to_jiffies(THRONE_COALESCE_MS));
+}
+
+static inline bool throne_tracked(int target)
+{
+	return atomic_read(&throne_completed) - target >= 0;
+}
+
+bool ksu_wait_track_throne(uid_t uid, unsigned long timeout)
+{
+	int target = atomic_read(&throne_requested);
+
+	if (throne_tracked(target))
+		return true;
+
+	// only a package the table doesn't know yet can be crowned by the
+	// pending scan, everyone else is verified on demand right away
+	if (packages_loaded && is_appid_listed(uid % 100000))
+		return true;
+
+	// never pull the scan forward: callers are unprivileged and would
+	// defeat the coalescing window by looping on prctl
+	return wait_event_timeout(throne_waitq, throne_tracked(target),
+				  timeout) > 0;
 }
 
 void ksu_throne_tracker_init()
 {
-	// nothing to do
+	apk_verify_wq = alloc_workqueue("ksu_apk_verify", WQ_UNBOUND,
+					num_online_cpus());
+	if (!apk_verify_wq)
+		pr_err("alloc apk verify workqueue failed, verify inline\n");
 }
 
 void ksu_throne_tracker_exit()
 {
-	// nothing to do
+	cancel_delayed_work_sync(&throne_work);
+	if (apk_verify_wq) {
+		destroy_workqueue(apk_verify_wq);
+		apk_verify_wq = NULL;
+	}
+
+	struct uid_data *np;
+	struct hlist_node *tmp;
+	int bkt;
+
+	mutex_lock(&throne_mutex);
+	hash_for_each_safe (packages_table, bkt, tmp, np, node) {
+		hash_del(&np->node);
+		kfree(np);
+	}
+	packages_loaded = false;
+	mutex_unlock(&throne_mutex);
 }
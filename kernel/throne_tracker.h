@@ -1,10 +1,25 @@
 #ifndef __KSU_H_UID_OBSERVER
 #define __KSU_H_UID_OBSERVER
 
+#include <linux/types.h>
+
 void ksu_throne_tracker_init();
 
 void ksu_throne_tracker_exit();
 
 void track_throne();
 
+// Schedule track_throne() on the ksu workqueue, renames within the
+// coalescing window collapse into a single run.
+void ksu_queue_track_throne(void);
+
+// Wait until every track_throne() requested so far has completed, unless
+// `uid` is already in packages.list and the pending run can't crown it.
+// Returns false on timeout.
+bool ksu_wait_track_throne(uid_t uid, unsigned long timeout);
+
+// Verify only the base.apk of `package` and crown it if it is the manager,
+// `uid` must match the package's uid in packages.list.
+bool ksu_verify_manager_package(const char *package, uid_t uid);
+
 #endif
@@ -0,0 +1,116 @@
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/workqueue.h>
+
+#include "kernel_compat.h"
+#include "klog.h" // IWYU pragma: keep
+#include "ksu.h"
+#include "timeline.h"
+
+#define KERNEL_SU_TIMELINE "/data/adb/ksu/log/kernel_timeline.json"
+#define TIMELINE_FORMAT_VERSION 1
+#define TIMELINE_SIZE 32 // must be a power of 2
+#define TIMELINE_JSON_SIZE 4096
+
+static const char *const event_names[KSU_BOOT_EVENT_MAX] = {
+	[KSU_BOOT_MODULE_INIT] = "module_init",
+	[KSU_BOOT_SECOND_STAGE] = "second_stage",
+	[KSU_BOOT_RULES_APPLIED] = "rules_applied",
+	[KSU_BOOT_VFS_READ_HOOK_ARMED] = "vfs_read_hook_armed",
+	[KSU_BOOT_RC_INJECTED] = "rc_injected",
+	[KSU_BOOT_VFS_READ_HOOK_STOPPED] = "vfs_read_hook_stopped",
+	[KSU_BOOT_FIRST_APP_PROCESS] = "first_app_process",
+	[KSU_BOOT_EXECVE_HOOK_STOPPED] = "execve_hook_stopped",
+	[KSU_BOOT_POST_FS_DATA] = "post_fs_data",
+	[KSU_BOOT_ALLOWLIST_LOADED] = "allowlist_loaded",
+	[KSU_BOOT_INPUT_HOOK_STOPPED] = "input_hook_stopped",
+	[KSU_BOOT_MODULE_MOUNTED] = "module_mounted",
+	[KSU_BOOT_COMPLETED] = "boot_completed",
+};
+
+struct timeline_entry {
+	u64 ts_ns; // CLOCK_MONOTONIC, same clock as userspace can read
+	pid_t pid;
+	u16 event;
+	u16 cpu;
+};
+
+static struct timeline_entry timeline[TIMELINE_SIZE];
+static atomic_t timeline_head = ATOMIC_INIT(0);
+
+void ksu_timeline_record(enum ksu_boot_event event)
+{
+	unsigned int slot;
+	struct timeline_entry *entry;
+
+	if (event >= KSU_BOOT_EVENT_MAX)
+		return;
+
+	slot = atomic_inc_return(&timeline_head) - 1;
+	entry = &timeline[slot & (TIMELINE_SIZE - 1)];
+	entry->ts_ns = ktime_get_ns();
+	entry->pid = current->pid;
+	entry->event = event;
+	entry->cpu = raw_smp_processor_id();
+}
+
+static void do_save_timeline(struct work_struct *work)
+{
+	unsigned int head = atomic_read(&timeline_head);
+	unsigned int start = head > TIMELINE_SIZE ? head - TIMELINE_SIZE : 0;
+	unsigned int i;
+	struct file *fp;
+	loff_t off = 0;
+	char *buf;
+	int len;
+
+	buf = kmalloc(TIMELINE_JSON_SIZE, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	len = scnprintf(buf, TIMELINE_JSON_SIZE,
+			"{\"version\":%d,\"clock\":\"monotonic\","
+			"\"dropped\":%u,\"events\":[",
+			TIMELINE_FORMAT_VERSION, start);
+	for (i = start; i < head; i++) {
+		struct timeline_entry *entry = &timeline[i & (TIMELINE_SIZE - 1)];
+
+		len += scnprintf(buf + len, TIMELINE_JSON_SIZE - len,
+				 "%s{\"name\":\"%s\",\"ts_ns\":%llu,"
+				 "\"pid\":%d,\"cpu\":%u}",
+				 i == start ? "" : ",", event_names[entry->event],
+				 entry->ts_ns, entry->pid, entry->cpu);
+	}
+	len += scnprintf(buf + len, TIMELINE_JSON_SIZE - len, "]}\n");
+
+	fp = ksu_filp_open_compat(KERNEL_SU_TIMELINE,
+				  O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (IS_ERR(fp)) {
+		pr_err("save timeline create file failed: %ld\n", PTR_ERR(fp));
+		goto out;
+	}
+
+	if (ksu_kernel_write_compat(fp, buf, len, &off) != len)
+		pr_err("save timeline write failed\n");
+
+	filp_close(fp, 0);
+out:
+	kfree(buf);
+}
+
+static DECLARE_WORK(timeline_save_work, do_save_timeline);
+
+void ksu_timeline_save(void)
+{
+	ksu_queue_work(&timeline_save_work);
+}
+
+void ksu_timeline_exit(void)
+{
+	cancel_work_sync(&timeline_save_work);
+}
@@ -0,0 +1,33 @@
+#ifndef __KSU_H_TIMELINE
+#define __KSU_H_TIMELINE
+
+#include <linux/types.h>
+
+enum ksu_boot_event {
+	KSU_BOOT_MODULE_INIT,
+	KSU_BOOT_SECOND_STAGE,
+	KSU_BOOT_RULES_APPLIED,
+	KSU_BOOT_VFS_READ_HOOK_ARMED,
+	KSU_BOOT_RC_INJECTED,
+	KSU_BOOT_VFS_READ_HOOK_STOPPED,
+	KSU_BOOT_FIRST_APP_PROCESS,
+	KSU_BOOT_EXECVE_HOOK_STOPPED,
+	KSU_BOOT_POST_FS_DATA,
+	KSU_BOOT_ALLOWLIST_LOADED,
+	KSU_BOOT_INPUT_HOOK_STOPPED,
+	KSU_BOOT_MODULE_MOUNTED,
+	KSU_BOOT_COMPLETED,
+	KSU_BOOT_EVENT_MAX,
+};
+
+// Safe to call from any context, including kprobe handlers.
+void ksu_timeline_record(enum ksu_boot_event event);
+
+// Dump the recorded events as JSON under /data/adb/ksu/log, asynchronously.
+// Saved at post-fs-data and module-mounted so that a boot that stalls later
+// still leaves a timeline, and rewritten with every event at boot-completed.
+void ksu_timeline_save(void);
+
+void ksu_timeline_exit(void);
+
+#endif
@@ -0,0 +1,240 @@
+use anyhow::{Context, Result};
+use log::warn;
+use serde_json::{json, Value};
+use std::{path::PathBuf, sync::Mutex};
+
+use crate::defs;
+
+// Timing of every boot step ksud performs. Each stage (post-fs-data,
+// service, boot-completed) runs in its own ksud process and appends its
+// steps to the profile of the current boot, identified by the kernel boot
+// id. Times are CLOCK_MONOTONIC nanoseconds like the kernel timeline in
+// kernel_timeline.json, so both can be read side by side.
+
+const PROFILE_VERSION: u64 = 1;
+const PROFILE_PREFIX: &str = "boot_profile";
+/// profiles of this many boots are kept, boot_profile.0.json is the latest
+const PROFILE_KEEP: usize = 10;
+const KERNEL_TIMELINE: &str = "kernel_timeline.json";
+
+struct Step {
+    name: String,
+    start_ns: u64,
+    end_ns: u64,
+    killed: bool,
+}
+
+static STEPS: Mutex<Vec<Step>> = Mutex::new(Vec::new());
+
+#[cfg(unix)]
+pub fn now_ns() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe {
+        libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts);
+    }
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+#[cfg(not(unix))]
+pub fn now_ns() -> u64 {
+    0
+}
+
+fn push(name: String, start_ns: u64, killed: bool) {
+    let end_ns = now_ns();
+    if let Ok(mut steps) = STEPS.lock() {
+        steps.push(Step {
+            name,
+            start_ns,
+            end_ns,
+            killed,
+        });
+    }
+}
+
+/// Record a step that ran from `start_ns` until now
+pub fn record(name: impl Into<String>, start_ns: u64) {
+    push(name.into(), start_ns, false);
+}
+
+/// Record a step that ran from `start_ns` until it was killed now
+pub fn record_killed(name: impl Into<String>, start_ns: u64) {
+    push(name.into(), start_ns, true);
+}
+
+/// Run `f` as a named step of the current stage
+pub fn step<T>(name: &str, f: impl FnOnce() -> T) -> T {
+    let start_ns = now_ns();
+    let result = f();
+    record(name, start_ns);
+    result
+}
+
+/// Collects the steps of a boot stage, they are saved when it goes out of scope
+pub struct Stage {
+    name: &'static str,
+    start_ns: u64,
+}
+
+impl Stage {
+    pub fn begin(name: &'static str) -> Stage {
+        Stage {
+            name,
+            start_ns: now_ns(),
+        }
+    }
+}
+
+impl Drop for Stage {
+    fn drop(&mut self) {
+        let end_ns = now_ns();
+        let steps = STEPS
+            .lock()
+            .map(|mut steps| std::mem::take(&mut *steps))
+            .unwrap_or_default();
+        let stage = json!({
+            "name": self.name,
+            "start_ns": self.start_ns,
+            "end_ns": end_ns,
+            "steps": steps
+                .iter()
+                .map(|s| {
+                    let mut step =
+                        json!({"name": s.name, "start_ns": s.start_ns, "end_ns": s.end_ns});
+                    if s.killed {
+                        step["killed"] = json!(true);
+                    }
+                    step
+                })
+                .collect::<Vec<_>>(),
+        });
+        if let Err(e) = save_stage(stage) {
+            warn!("save boot profile failed: {e:#}");
+        }
+    }
+}
+
+fn profile_path(index: usize) -> PathBuf {
+    PathBuf::from(defs::LOG_DIR).join(format!("{PROFILE_PREFIX}.{index}.json"))
+}
+
+fn boot_id() -> String {
+    std::fs::read_to_string("/proc/sys/kernel/random/boot_id")
+        .map(|id| id.trim().to_string())
+        .unwrap_or_default()
+}
+
+fn read_json(path: &PathBuf) -> Option<Value> {
+    serde_json::from_slice(&std::fs::read(path).ok()?).ok()
+}
+
+fn save_stage(stage: Value) -> Result<()> {
+    crate::utils::ensure_dir_exists(defs::LOG_DIR)?;
+    let boot_id = boot_id();
+    let latest = profile_path(0);
+
+    let mut profile = match read_json(&latest) {
+        Some(p) if p["boot_id"].as_str() == Some(boot_id.as_str()) => p,
+        _ => {
+            // first stage of this boot, rotate the older profiles
+            for i in (0..PROFILE_KEEP - 1).rev() {
+                let _ = std::fs::rename(profile_path(i), profile_path(i + 1));
+            }
+            json!({"version": PROFILE_VERSION, "boot_id": boot_id, "stages": []})
+        }
+    };
+    if let Some(stages) = profile["stages"].as_array_mut() {
+        stages.push(stage);
+    }
+
+    let tmp = latest.with_extension("json.tmp");
+    std::fs::write(&tmp, serde_json::to_vec(&profile)?)?;
+    std::fs::rename(&tmp, &latest).with_context(|| format!("rename {}", latest.display()))?;
+    Ok(())
+}
+
+fn ms(ns: u64) -> f64 {
+    ns as f64 / 1_000_000.0
+}
+
+/// `ksud debug boot-profile`: the last `boots` profiles side by side, one row
+/// per step with its duration in ms, newest boot first. Steps that were killed
+/// are marked with a `!`.
+pub fn show(boots: usize) -> Result<()> {
+    let profiles: Vec<Value> = (0..boots.clamp(1, PROFILE_KEEP))
+        .map_while(|i| read_json(&profile_path(i)))
+        .collect();
+    anyhow::ensure!(!profiles.is_empty(), "no boot profile recorded yet");
+
+    // rows in order of first appearance, latest boot first
+    let mut rows: Vec<String> = vec![];
+    let mut cells: Vec<std::collections::HashMap<String, (u64, bool)>> = vec![];
+    for profile in &profiles {
+        let mut durations = std::collections::HashMap::new();
+        for stage in profile["stages"].as_array().into_iter().flatten() {
+            let stage_name = stage["name"].as_str().unwrap_or("?");
+            let mut add = |name: String, v: &Value| {
+                let (Some(start), Some(end)) = (v["start_ns"].as_u64(), v["end_ns"].as_u64())
+                else {
+                    return;
+                };
+                if !rows.contains(&name) {
+                    rows.push(name.clone());
+                }
+                let cell = durations.entry(name).or_insert((0, false));
+                cell.0 += end.saturating_sub(start);
+                cell.1 |= v["killed"].as_bool().unwrap_or(false);
+            };
+            add(stage_name.to_string(), stage);
+            for step in stage["steps"].as_array().into_iter().flatten() {
+                let name = format!("  {}", step["name"].as_str().unwrap_or("?"));
+                add(format!("{stage_name}/{name}"), step);
+            }
+        }
+        cells.push(durations);
+    }
+
+    let width = rows.iter().map(|r| r.len()).max().unwrap_or(0).max(4);
+    print!("{:width$}", "step");
+    for i in 0..profiles.len() {
+        print!(" {:>10}", format!("boot -{i}"));
+    }
+    println!();
+    for row in &rows {
+        // the stage prefix only keeps steps of different stages apart
+        let label = row.split_once('/').map_or(row.as_str(), |(_, s)| s);
+        print!("{label:width$}");
+        for durations in &cells {
+            match durations.get(row) {
+                Some((ns, false)) => print!(" {:>10.1}", ms(*ns)),
+                Some((ns, true)) => print!(" {:>10}", format!("{:.1}!", ms(*ns))),
+                None => print!(" {:>10}", "-"),
+            }
+        }
+        println!();
+    }
+
+    // the kernel rewrites its timeline every boot, it belongs to the latest
+    let timeline = PathBuf::from(defs::LOG_DIR).join(KERNEL_TIMELINE);
+    if let Some(timeline) = read_json(&timeline) {
+        println!("\nkernel timeline of the latest boot (ms since boot):");
+        for event in timeline["events"].as_array().into_iter().flatten() {
+            if let (Some(name), Some(ts)) = (event["name"].as_str(), event["ts_ns"].as_u64()) {
+                println!("{name:width$} {:>10.1}", ms(ts));
+            }
+        }
+        if let Some(latest) = profiles[0]["stages"].as_array() {
+            for stage in latest {
+                if let (Some(name), Some(ts)) = (stage["name"].as_str(), stage["start_ns"].as_u64())
+                {
+                    println!("{:width$} {:>10.1}", format!("ksud {name}"), ms(ts));
+                }
+            }
+        }
+    }
+
+    Ok(())
+}
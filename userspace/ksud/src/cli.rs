@@ -170,6 +170,24 @@ enum Debug {
         /// punch hole
         #[arg(short, long, default_value = "false")]
         punch_hole: bool,
+        /// also copy with the legacy loop and compare the throughput
+        #[arg(short, long, default_value = "false")]
+        compare: bool,
+    },
+
+    /// Measure sepolicy rule parser throughput on synthetic rule files
+    #[cfg(feature = "sepolicy-bench")]
+    SepolicyBench {
+        /// iterations per corpus
+        #[arg(short, long, default_value_t = 10)]
+        iterations: usize,
+    },
+
+    /// Show per step timings of the last boots side by side
+    BootProfile {
+        /// number of boots to show
+        #[arg(short = 'n', long, default_value_t = 3)]
+        boots: usize,
     },
 
     /// For testing
@@ -195,6 +213,9 @@ enum Sepolicy {
         /// sepolicy statements
         sepolicy: String,
     },
+
+    /// Dump the rules KernelSU added to the live policy, grouped by source
+    Dump,
 }
 
 #[derive(clap::Subcommand, Debug)]
@@ -313,9 +334,10 @@ pub fn run() -> Result<()> {
         Commands::Install { magiskboot } => utils::install(magiskboot),
         Commands::Uninstall { magiskboot } => utils::uninstall(magiskboot),
         Commands::Sepolicy { command } => match command {
-            Sepolicy::Patch { sepolicy } => crate::sepolicy::live_patch(&sepolicy),
-            Sepolicy::Apply { file } => crate::sepolicy::apply_file(file),
+            Sepolicy::Patch { sepolicy } => crate::sepolicy::live_patch(&sepolicy, "cli"),
+            Sepolicy::Apply { file } => crate::sepolicy::apply_file(file, "cli"),
             Sepolicy::Check { sepolicy } => crate::sepolicy::check_rule(&sepolicy),
+            Sepolicy::Dump => crate::sepolicy::dump(),
         },
         Commands::Services => init_event::on_services(),
         Commands::Profile { command } => match command {
@@ -346,10 +368,11 @@ pub fn run() -> Result<()> {
                 src,
                 dst,
                 punch_hole,
-            } => {
-                utils::copy_sparse_file(src, dst, punch_hole)?;
-                Ok(())
-            }
+                compare,
+            } => debug::xcp(&src, &dst, punch_hole, compare),
+            #[cfg(feature = "sepolicy-bench")]
+            Debug::SepolicyBench { iterations } => crate::sepolicy::bench(iterations),
+            Debug::BootProfile { boots } => crate::boot_profile::show(boots),
             Debug::Test => assets::ensure_binaries(false),
         },
 
@@ -50,3 +50,31 @@ pub fn set_manager(pkg: &str) -> Result<()> {
     let _ = Command::new("am").args(["force-stop", pkg]).status();
     Ok(())
 }
+
+fn report_copy(stats: &crate::utils::CopyStats, elapsed: std::time::Duration) {
+    let throughput = (stats.data_bytes as f64 / elapsed.as_secs_f64().max(1e-9)) as u64;
+    println!(
+        "{}: {} of data in {:?}, {}/s",
+        stats.method,
+        humansize::format_size(stats.data_bytes, humansize::DECIMAL),
+        elapsed,
+        humansize::format_size(throughput, humansize::DECIMAL)
+    );
+}
+
+/// Copy a sparse file and report the throughput, with `compare` also for the
+/// legacy copy loop
+pub fn xcp(src: &str, dst: &str, punch_hole: bool, compare: bool) -> Result<()> {
+    let start = std::time::Instant::now();
+    let stats = crate::utils::copy_sparse_file_stats(src, dst, punch_hole)?;
+    report_copy(&stats, start.elapsed());
+
+    if compare {
+        let legacy_dst = format!("{dst}.legacy");
+        let start = std::time::Instant::now();
+        let stats = crate::utils::copy_sparse_file_legacy(src, &legacy_dst, punch_hole)?;
+        report_copy(&stats, start.elapsed());
+        std::fs::remove_file(&legacy_dst)?;
+    }
+    Ok(())
+}
@@ -10,6 +10,9 @@ pub const PROFILE_SELINUX_DIR: &str = concatcp!(PROFILE_DIR, "selinux/");
 pub const PROFILE_TEMPLATE_DIR: &str = concatcp!(PROFILE_DIR, "templates/");
 
 pub const KSURC_PATH: &str = concatcp!(WORKING_DIR, ".ksurc");
+pub const SEPOLICY_CACHE_PATH: &str = concatcp!(WORKING_DIR, "sepolicy.cache");
+pub const MODULE_INDEX_PATH: &str = concatcp!(WORKING_DIR, "module_index.json");
+pub const STAGE_CONFIG_PATH: &str = concatcp!(WORKING_DIR, "stage.prop");
 pub const KSU_OVERLAY_SOURCE: &str = "KSU";
 pub const DAEMON_PATH: &str = concatcp!(ADB_DIR, "ksud");
 pub const MAGISKBOOT_PATH: &str = concatcp!(BINARY_DIR, "magiskboot");
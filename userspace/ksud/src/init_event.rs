@@ -4,7 +4,7 @@ use std::{collections::HashMap, path::Path};
 
 use crate::module::prune_modules;
 use crate::{
-    assets, defs, ksucalls, mount, restorecon,
+    assets, boot_profile, defs, ksucalls, module_index, mount, restorecon,
     utils::{self, ensure_clean_dir},
 };
 
@@ -35,48 +35,36 @@ fn mount_partition(partition_name: &str, lowerdir: &Vec<String>) -> Result<()> {
 
 pub fn mount_modules_systemlessly(module_dir: &str) -> Result<()> {
     // construct overlay mount params
-    let dir = std::fs::read_dir(module_dir);
-    let Ok(dir) = dir else {
+    let Ok(modules) = module_index::load(Path::new(module_dir)) else {
         bail!("open {} failed", defs::MODULE_DIR);
     };
 
     let mut system_lowerdir: Vec<String> = Vec::new();
 
-    let partition = vec!["vendor", "product", "system_ext", "odm", "oem"];
     let mut partition_lowerdir: HashMap<String, Vec<String>> = HashMap::new();
-    for ele in &partition {
-        partition_lowerdir.insert((*ele).to_string(), Vec::new());
+    for ele in module_index::PARTITIONS {
+        partition_lowerdir.insert(ele.to_string(), Vec::new());
     }
 
-    for entry in dir.flatten() {
-        let module = entry.path();
-        if !module.is_dir() {
+    for module in modules {
+        if module.disabled {
+            info!("module: {} is disabled, ignore!", module.path.display());
             continue;
         }
-        let disabled = module.join(defs::DISABLE_FILE_NAME).exists();
-        if disabled {
-            info!("module: {} is disabled, ignore!", module.display());
-            continue;
-        }
-        let skip_mount = module.join(defs::SKIP_MOUNT_FILE_NAME).exists();
-        if skip_mount {
-            info!("module: {} skip_mount exist, skip!", module.display());
+        if module.skip_mount {
+            info!("module: {} skip_mount exist, skip!", module.path.display());
             continue;
         }
 
-        let module_system = Path::new(&module).join("system");
-        if module_system.is_dir() {
-            system_lowerdir.push(format!("{}", module_system.display()));
+        if module.system {
+            system_lowerdir.push(format!("{}", module.path.join("system").display()));
         }
 
-        for part in &partition {
-            // if /partition is a mountpoint, we would move it to $MODPATH/$partition when install
-            // otherwise it must be a symlink and we don't need to overlay!
-            let part_path = Path::new(&module).join(part);
-            if part_path.is_dir() {
-                if let Some(v) = partition_lowerdir.get_mut(*part) {
-                    v.push(format!("{}", part_path.display()));
-                }
+        // if /partition is a mountpoint, we would move it to $MODPATH/$partition when install
+        // otherwise it must be a symlink and we don't need to overlay!
+        for part in &module.partitions {
+            if let Some(v) = partition_lowerdir.get_mut(part) {
+                v.push(format!("{}", module.path.join(part).display()));
             }
         }
     }
@@ -98,6 +86,7 @@ pub fn mount_modules_systemlessly(module_dir: &str) -> Result<()> {
 
 pub fn on_post_data_fs() -> Result<()> {
     ksucalls::report_post_fs_data();
+    let _profile = boot_profile::Stage::begin("post-fs-data");
 
     utils::umask(0);
 
@@ -119,7 +108,9 @@ pub fn on_post_data_fs() -> Result<()> {
         warn!("safe mode, skip common post-fs-data.d scripts");
     } else {
         // Then exec common post-fs-data scripts
-        if let Err(e) = crate::module::exec_common_scripts("post-fs-data.d", true) {
+        if let Err(e) = boot_profile::step("post-fs-data.d", || {
+            crate::module::exec_common_scripts("post-fs-data.d", true)
+        }) {
             warn!("exec common post-fs-data scripts failed: {}", e);
         }
     }
@@ -135,7 +126,8 @@ pub fn on_post_data_fs() -> Result<()> {
     // we should clean the module mount point if it exists
     ensure_clean_dir(module_dir)?;
 
-    assets::ensure_binaries(true).with_context(|| "Failed to extract bin assets")?;
+    boot_profile::step("ensure_binaries", || assets::ensure_binaries(true))
+        .with_context(|| "Failed to extract bin assets")?;
 
     if Path::new(module_update_img).exists() {
         if module_update_flag.exists() {
@@ -158,8 +150,10 @@ pub fn on_post_data_fs() -> Result<()> {
     // we should always mount the module.img to module dir
     // becuase we may need to operate the module dir in safe mode
     info!("mount module image: {target_update_img} to {module_dir}");
-    mount::AutoMountExt4::try_new(target_update_img, module_dir, false)
-        .with_context(|| "mount module image failed".to_string())?;
+    boot_profile::step("mount_image", || {
+        mount::AutoMountExt4::try_new(target_update_img, module_dir, false)
+    })
+    .with_context(|| "mount module image failed".to_string())?;
 
     // tell kernel that we've mount the module, so that it can do some optimization
     ksucalls::report_module_mounted();
@@ -173,45 +167,53 @@ pub fn on_post_data_fs() -> Result<()> {
         return Ok(());
     }
 
-    if let Err(e) = prune_modules() {
+    if let Err(e) = boot_profile::step("prune_modules", prune_modules) {
         warn!("prune modules failed: {}", e);
     }
 
-    if let Err(e) = restorecon::restorecon() {
+    if let Err(e) = boot_profile::step("restorecon", restorecon::restorecon) {
         warn!("restorecon failed: {}", e);
     }
 
-    // load sepolicy.rule
-    if crate::module::load_sepolicy_rule().is_err() {
-        warn!("load sepolicy.rule failed");
+    // load sepolicy.rule of modules and root profile sepolicy in one go
+    let sepolicy_start = boot_profile::now_ns();
+    let mut sepolicy_sources = crate::module::sepolicy_rule_sources().unwrap_or_else(|e| {
+        warn!("collect sepolicy.rule failed: {}", e);
+        vec![]
+    });
+    match crate::profile::sepolicy_sources() {
+        Ok(sources) => sepolicy_sources.extend(sources),
+        Err(e) => warn!("collect root profile sepolicy failed: {}", e),
     }
-
-    if let Err(e) = crate::profile::apply_sepolies() {
-        warn!("apply root profile sepolicy failed: {}", e);
+    if let Err(e) = crate::sepolicy::apply_sources(&sepolicy_sources) {
+        warn!("apply sepolicy failed: {}", e);
     }
+    boot_profile::record("sepolicy", sepolicy_start);
 
     // mount temp dir
-    if let Err(e) = mount::mount_tmpfs(utils::get_tmp_path()) {
+    if let Err(e) = boot_profile::step("mount_tmpfs", || mount::mount_tmpfs(utils::get_tmp_path()))
+    {
         warn!("do temp dir mount failed: {}", e);
     }
 
     // exec modules post-fs-data scripts
-    // TODO: Add timeout
-    if let Err(e) = crate::module::exec_stage_script("post-fs-data", true) {
+    if let Err(e) = boot_profile::step("post-fs-data.sh", || {
+        crate::module::exec_stage_script("post-fs-data", true)
+    }) {
         warn!("exec post-fs-data scripts failed: {}", e);
     }
 
     // load system.prop
-    if let Err(e) = crate::module::load_system_prop() {
+    if let Err(e) = boot_profile::step("system.prop", crate::module::load_system_prop) {
         warn!("load system.prop failed: {}", e);
     }
 
     // mount module systemlessly by overlay
-    if let Err(e) = mount_modules_systemlessly(module_dir) {
+    if let Err(e) = boot_profile::step("overlay_mount", || mount_modules_systemlessly(module_dir)) {
         warn!("do systemless mount failed: {}", e);
     }
 
-    run_stage("post-mount", true);
+    boot_profile::step("post-mount", || run_stage("post-mount", true));
 
     std::env::set_current_dir("/").with_context(|| "failed to chdir to /")?;
 
@@ -241,7 +243,8 @@ fn run_stage(stage: &str, block: bool) {
 
 pub fn on_services() -> Result<()> {
     info!("on_services triggered!");
-    run_stage("service", false);
+    let _profile = boot_profile::Stage::begin("service");
+    boot_profile::step("service", || run_stage("service", false));
 
     Ok(())
 }
@@ -249,6 +252,7 @@ pub fn on_services() -> Result<()> {
 pub fn on_boot_completed() -> Result<()> {
     ksucalls::report_boot_complete();
     info!("on_boot_completed triggered!");
+    let _profile = boot_profile::Stage::begin("boot-completed");
     let module_update_img = Path::new(defs::MODULE_UPDATE_IMG);
     let module_img = Path::new(defs::MODULE_IMG);
     if module_update_img.exists() {
@@ -261,7 +265,7 @@ pub fn on_boot_completed() -> Result<()> {
         }
     }
 
-    run_stage("boot-completed", false);
+    boot_profile::step("boot-completed", || run_stage("boot-completed", false));
 
     Ok(())
 }
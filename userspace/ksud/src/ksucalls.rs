@@ -2,6 +2,33 @@ const EVENT_POST_FS_DATA: u64 = 1;
 const EVENT_BOOT_COMPLETED: u64 = 2;
 const EVENT_MODULE_MOUNTED: u64 = 3;
 
+#[cfg(any(target_os = "linux", target_os = "android"))]
+const KERNEL_SU_OPTION: u32 = 0xDEAD_BEEF;
+
+pub const CMD_SET_SEPOLICY_BATCH: u64 = 14;
+pub const CMD_GET_SEPOLICY_DUMP: u64 = 15;
+
+/// Issue a raw KernelSU prctl, returns true if the kernel replied with success.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn ksuctl(cmd: u64, arg3: *mut libc::c_void, arg4: *mut libc::c_void) -> bool {
+    let mut result: u32 = 0;
+    unsafe {
+        libc::prctl(
+            KERNEL_SU_OPTION as libc::c_int,
+            cmd as libc::c_ulong,
+            arg3,
+            arg4,
+            &mut result as *mut u32,
+        );
+    }
+    result == KERNEL_SU_OPTION
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub fn ksuctl(_cmd: u64, _arg3: *mut libc::c_void, _arg4: *mut libc::c_void) -> bool {
+    false
+}
+
 #[cfg(any(target_os = "linux", target_os = "android"))]
 pub fn get_version() -> i32 {
     rustix::process::ksu_get_version()
@@ -1,16 +1,19 @@
 mod apk_sign;
 mod assets;
 mod boot_patch;
+mod boot_profile;
 mod cli;
 mod debug;
 mod defs;
 mod init_event;
 mod ksucalls;
 mod module;
+mod module_index;
 mod mount;
 mod profile;
 mod restorecon;
 mod sepolicy;
+mod stage_scheduler;
 mod su;
 mod utils;
 
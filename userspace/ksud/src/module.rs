@@ -1,9 +1,9 @@
 #[allow(clippy::wildcard_imports)]
 use crate::utils::*;
 use crate::{
-    assets, defs, ksucalls, mount,
+    assets, boot_profile, defs, ksucalls, module_index, mount,
     restorecon::{restore_syscon, setsyscon},
-    sepolicy, utils,
+    sepolicy, stage_scheduler, utils,
 };
 
 use anyhow::{anyhow, bail, ensure, Context, Result};
@@ -76,19 +76,25 @@ fn ensure_boot_completed() -> Result<()> {
 }
 
 fn mark_update() -> Result<()> {
+    sepolicy::invalidate_cache();
     ensure_file_exists(concatcp!(defs::WORKING_DIR, defs::UPDATE_FILE_NAME))
 }
 
 fn mark_module_state(module: &str, flag_file: &str, create_or_delete: bool) -> Result<()> {
+    sepolicy::invalidate_cache();
     let module_state_file = Path::new(defs::MODULE_DIR).join(module).join(flag_file);
-    if create_or_delete {
+    let result = if create_or_delete {
         ensure_file_exists(module_state_file)
     } else {
         if module_state_file.exists() {
             std::fs::remove_file(module_state_file)?;
         }
         Ok(())
+    };
+    if let Err(e) = module_index::rebuild(Path::new(defs::MODULE_DIR)) {
+        warn!("rebuild module index failed: {e}");
     }
+    result
 }
 
 fn foreach_module(active_only: bool, mut f: impl FnMut(&Path) -> Result<()>) -> Result<()> {
@@ -116,10 +122,6 @@ fn foreach_module(active_only: bool, mut f: impl FnMut(&Path) -> Result<()>) ->
     Ok(())
 }
 
-fn foreach_active_module(f: impl FnMut(&Path) -> Result<()>) -> Result<()> {
-    foreach_module(true, f)
-}
-
 fn check_image(img: &str) -> Result<()> {
     let result = Command::new("e2fsck")
         .args(["-yf", img])
@@ -140,42 +142,43 @@ fn check_image(img: &str) -> Result<()> {
     Ok(())
 }
 
-pub fn load_sepolicy_rule() -> Result<()> {
-    foreach_active_module(|path| {
-        let rule_file = path.join("sepolicy.rule");
-        if !rule_file.exists() {
-            return Ok(());
-        }
-        info!("load policy: {}", &rule_file.display());
-
-        if sepolicy::apply_file(&rule_file).is_err() {
-            warn!("Failed to load sepolicy.rule for {}", &rule_file.display());
-        }
-        Ok(())
-    })?;
-
-    Ok(())
+/// sepolicy.rule of every active module, labelled for the kernel's accounting
+pub fn sepolicy_rule_sources() -> Result<Vec<(String, PathBuf)>> {
+    // the index is sorted, the cache key must not depend on read_dir order
+    let sources = module_index::active_modules()?
+        .into_iter()
+        .filter(|m| m.sepolicy_rule)
+        .map(|m| {
+            let source = format!(
+                "module:{}",
+                m.path.file_name().unwrap_or_default().to_string_lossy()
+            );
+            (source, m.path.join("sepolicy.rule"))
+        })
+        .collect();
+
+    Ok(sources)
 }
 
-fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
-    info!("exec {}", path.as_ref().display());
-
-    let mut command = &mut Command::new(assets::BUSYBOX_PATH);
+/// Command running a module script with the environment modules expect, in
+/// its own process group so it can be killed with everything it started
+pub fn script_command(path: &Path) -> Command {
+    let mut command = Command::new(assets::BUSYBOX_PATH);
     #[cfg(unix)]
     {
-        command = command.process_group(0);
-        command = unsafe {
+        command.process_group(0);
+        unsafe {
             command.pre_exec(|| {
                 // ignore the error?
                 switch_cgroups();
                 Ok(())
-            })
-        };
+            });
+        }
     }
-    command = command
-        .current_dir(path.as_ref().parent().unwrap())
+    command
+        .current_dir(path.parent().unwrap())
         .arg("sh")
-        .arg(path.as_ref())
+        .arg(path)
         .env("ASH_STANDALONE", "1")
         .env("KSU", "true")
         .env("KSU_KERNEL_VER_CODE", ksucalls::get_version().to_string())
@@ -189,7 +192,13 @@ fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
                 defs::BINARY_DIR.trim_end_matches('/')
             ),
         );
+    command
+}
 
+fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
+    info!("exec {}", path.as_ref().display());
+
+    let mut command = script_command(path.as_ref());
     let result = if wait {
         command.status().map(|_| ())
     } else {
@@ -199,15 +208,24 @@ fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
 }
 
 pub fn exec_stage_script(stage: &str, block: bool) -> Result<()> {
-    foreach_active_module(|module| {
-        let script_path = module.join(format!("{stage}.sh"));
-        if !script_path.exists() {
-            return Ok(());
+    let modules: Vec<_> = module_index::active_modules()?
+        .into_iter()
+        .filter(|m| m.has_script(stage))
+        .collect();
+    let config = stage_scheduler::Config::load();
+    let scripts = stage_scheduler::order_scripts(stage, &modules);
+
+    // non blocking stages start long running services, they are only spawned
+    if !block || config.mode == stage_scheduler::Mode::Sequential {
+        for script in &scripts {
+            let start = boot_profile::now_ns();
+            exec_script(&script.path, block)?;
+            boot_profile::record(format!("{stage}:{}", script.id), start);
         }
+        return Ok(());
+    }
 
-        exec_script(&script_path, block)
-    })?;
-
+    stage_scheduler::run(stage, scripts, &config);
     Ok(())
 }
 
@@ -234,12 +252,13 @@ pub fn exec_common_scripts(dir: &str, wait: bool) -> Result<()> {
 }
 
 pub fn load_system_prop() -> Result<()> {
-    foreach_active_module(|module| {
-        let system_prop = module.join("system.prop");
-        if !system_prop.exists() {
-            return Ok(());
+    for module in module_index::active_modules()? {
+        if !module.system_prop {
+            continue;
         }
-        info!("load {} system.prop", module.display());
+        let system_prop = module.path.join("system.prop");
+        info!("load {} system.prop", module.path.display());
+        let start = boot_profile::now_ns();
 
         // resetprop -n --file system.prop
         Command::new(assets::RESETPROP_PATH)
@@ -248,9 +267,18 @@ pub fn load_system_prop() -> Result<()> {
             .arg(&system_prop)
             .status()
             .with_context(|| format!("Failed to exec {}", system_prop.display()))?;
-
-        Ok(())
-    })?;
+        boot_profile::record(
+            format!(
+                "system.prop:{}",
+                module
+                    .path
+                    .file_name()
+                    .unwrap_or_default()
+                    .to_string_lossy()
+            ),
+            start,
+        );
+    }
 
     Ok(())
 }
@@ -0,0 +1,219 @@
+use anyhow::{Context, Result};
+use log::{info, warn};
+use serde_json::{json, Value};
+use std::path::{Path, PathBuf};
+
+use crate::defs;
+
+// Everything the boot stages want to know about a module, recorded once so
+// post-fs-data doesn't probe every flag file, script and partition dir of
+// every module again. The index is trusted only while the mtime of the module
+// dir and of every module in it are unchanged: creating or removing a flag
+// file, script or partition dir always updates the mtime of its parent.
+
+const INDEX_VERSION: u64 = 1;
+
+/// Partitions a module may overlay besides /system
+pub const PARTITIONS: [&str; 5] = ["vendor", "product", "system_ext", "odm", "oem"];
+
+#[derive(Debug, Default, Clone)]
+pub struct ModuleEntry {
+    pub path: PathBuf,
+    mtime: (i64, i64),
+    pub disabled: bool,
+    pub removed: bool,
+    pub skip_mount: bool,
+    pub system: bool,
+    /// entries of `PARTITIONS` the module has a directory for
+    pub partitions: Vec<String>,
+    /// stages with a `<stage>.sh` script
+    pub scripts: Vec<String>,
+    pub system_prop: bool,
+    pub sepolicy_rule: bool,
+}
+
+impl ModuleEntry {
+    /// not disabled and not going to be removed
+    pub fn is_active(&self) -> bool {
+        !self.disabled && !self.removed
+    }
+
+    pub fn has_script(&self, stage: &str) -> bool {
+        self.scripts.iter().any(|s| s == stage)
+    }
+
+    fn to_json(&self) -> Value {
+        json!({
+            "name": self.path.file_name().unwrap_or_default().to_string_lossy(),
+            "mtime": [self.mtime.0, self.mtime.1],
+            "disabled": self.disabled,
+            "removed": self.removed,
+            "skip_mount": self.skip_mount,
+            "system": self.system,
+            "partitions": self.partitions,
+            "scripts": self.scripts,
+            "system_prop": self.system_prop,
+            "sepolicy_rule": self.sepolicy_rule,
+        })
+    }
+
+    fn from_json(dir: &Path, v: &Value) -> Option<Self> {
+        let strings = |key: &str| -> Option<Vec<String>> {
+            v[key]
+                .as_array()?
+                .iter()
+                .map(|s| s.as_str().map(str::to_string))
+                .collect()
+        };
+        Some(ModuleEntry {
+            path: dir.join(v["name"].as_str()?),
+            mtime: json_mtime(&v["mtime"])?,
+            disabled: v["disabled"].as_bool()?,
+            removed: v["removed"].as_bool()?,
+            skip_mount: v["skip_mount"].as_bool()?,
+            system: v["system"].as_bool()?,
+            partitions: strings("partitions")?,
+            scripts: strings("scripts")?,
+            system_prop: v["system_prop"].as_bool()?,
+            sepolicy_rule: v["sepolicy_rule"].as_bool()?,
+        })
+    }
+}
+
+fn json_mtime(v: &Value) -> Option<(i64, i64)> {
+    Some((v[0].as_i64()?, v[1].as_i64()?))
+}
+
+#[cfg(unix)]
+fn mtime(path: &Path) -> Option<(i64, i64)> {
+    use std::os::unix::fs::MetadataExt;
+    let meta = std::fs::metadata(path).ok()?;
+    Some((meta.mtime(), meta.mtime_nsec()))
+}
+
+#[cfg(not(unix))]
+fn mtime(_path: &Path) -> Option<(i64, i64)> {
+    None
+}
+
+/// One read_dir per module instead of a stat for every file we care about
+fn scan_module(path: &Path) -> Result<ModuleEntry> {
+    let mut entry = ModuleEntry {
+        path: path.to_path_buf(),
+        mtime: mtime(path).unwrap_or_default(),
+        ..Default::default()
+    };
+    for file in std::fs::read_dir(path)?.flatten() {
+        let name = file.file_name();
+        let Some(name) = name.to_str() else {
+            continue;
+        };
+        // follow symlinks like Path::is_dir does, d_type is enough otherwise
+        let is_dir = match file.file_type() {
+            Ok(t) if t.is_symlink() => file.path().is_dir(),
+            Ok(t) => t.is_dir(),
+            Err(_) => false,
+        };
+        match name {
+            defs::DISABLE_FILE_NAME => entry.disabled = true,
+            defs::REMOVE_FILE_NAME => entry.removed = true,
+            defs::SKIP_MOUNT_FILE_NAME => entry.skip_mount = true,
+            "system.prop" => entry.system_prop = true,
+            "sepolicy.rule" => entry.sepolicy_rule = true,
+            "system" => entry.system = is_dir,
+            _ if is_dir && PARTITIONS.contains(&name) => entry.partitions.push(name.to_string()),
+            _ => {
+                if let Some(stage) = name.strip_suffix(".sh") {
+                    entry.scripts.push(stage.to_string());
+                }
+            }
+        }
+    }
+    entry.partitions.sort();
+    entry.scripts.sort();
+    Ok(entry)
+}
+
+fn scan(module_dir: &Path) -> Result<Vec<ModuleEntry>> {
+    let dir = std::fs::read_dir(module_dir)
+        .with_context(|| format!("open {} failed", module_dir.display()))?;
+    let mut modules = vec![];
+    for entry in dir.flatten() {
+        let path = entry.path();
+        if !path.is_dir() {
+            continue;
+        }
+        match scan_module(&path) {
+            Ok(module) => modules.push(module),
+            Err(e) => warn!("scan {} failed: {e}", path.display()),
+        }
+    }
+    modules.sort_by(|a, b| a.path.cmp(&b.path));
+    Ok(modules)
+}
+
+/// The stored index, if it still describes `module_dir`
+fn load_valid(module_dir: &Path) -> Option<Vec<ModuleEntry>> {
+    let content = std::fs::read(defs::MODULE_INDEX_PATH).ok()?;
+    let index: Value = serde_json::from_slice(&content).ok()?;
+    if index["version"].as_u64()? != INDEX_VERSION
+        || Path::new(index["dir"].as_str()?) != module_dir
+        || json_mtime(&index["mtime"])? != mtime(module_dir)?
+    {
+        return None;
+    }
+    let modules = index["modules"]
+        .as_array()?
+        .iter()
+        .map(|v| ModuleEntry::from_json(module_dir, v))
+        .collect::<Option<Vec<_>>>()?;
+    for module in &modules {
+        if mtime(&module.path)? != module.mtime {
+            info!("module index: {} changed", module.path.display());
+            return None;
+        }
+    }
+    Some(modules)
+}
+
+fn store(module_dir: &Path, dir_mtime: (i64, i64), modules: &[ModuleEntry]) -> Result<()> {
+    let index = json!({
+        "version": INDEX_VERSION,
+        "dir": module_dir.to_string_lossy(),
+        "mtime": [dir_mtime.0, dir_mtime.1],
+        "modules": modules.iter().map(ModuleEntry::to_json).collect::<Vec<_>>(),
+    });
+    let tmp = format!("{}.tmp", defs::MODULE_INDEX_PATH);
+    std::fs::write(&tmp, serde_json::to_vec(&index)?)?;
+    std::fs::rename(&tmp, defs::MODULE_INDEX_PATH)?;
+    Ok(())
+}
+
+/// Scan `module_dir` and store the result as the index
+pub fn rebuild(module_dir: &Path) -> Result<Vec<ModuleEntry>> {
+    // taken before the scan, a change racing with it invalidates the index
+    let dir_mtime = mtime(module_dir);
+    let modules = scan(module_dir)?;
+    if let Some(dir_mtime) = dir_mtime {
+        if let Err(e) = store(module_dir, dir_mtime, &modules) {
+            warn!("module index: store failed: {e}");
+        }
+    }
+    Ok(modules)
+}
+
+/// Every module in `module_dir` sorted by path, from the index if it is still
+/// valid and from a fresh scan otherwise
+pub fn load(module_dir: &Path) -> Result<Vec<ModuleEntry>> {
+    if let Some(modules) = load_valid(module_dir) {
+        return Ok(modules);
+    }
+    info!("module index: stale, rescan {}", module_dir.display());
+    rebuild(module_dir)
+}
+
+/// Active modules of /data/adb/modules
+pub fn active_modules() -> Result<Vec<ModuleEntry>> {
+    let modules = load(Path::new(defs::MODULE_DIR))?;
+    Ok(modules.into_iter().filter(ModuleEntry::is_active).collect())
+}
@@ -1,13 +1,13 @@
 use crate::utils::ensure_dir_exists;
 use crate::{defs, sepolicy};
 use anyhow::{Context, Result};
-use std::path::Path;
+use std::path::{Path, PathBuf};
 
 pub fn set_sepolicy(pkg: String, policy: String) -> Result<()> {
     ensure_dir_exists(defs::PROFILE_SELINUX_DIR)?;
-    let policy_file = Path::new(defs::PROFILE_SELINUX_DIR).join(pkg);
+    let policy_file = Path::new(defs::PROFILE_SELINUX_DIR).join(&pkg);
     std::fs::write(&policy_file, policy)?;
-    sepolicy::apply_file(&policy_file)?;
+    sepolicy::apply_file(&policy_file, &format!("profile:{pkg}"))?;
     Ok(())
 }
 
@@ -54,26 +54,29 @@ pub fn list_templates() -> Result<()> {
     Ok(())
 }
 
-pub fn apply_sepolies() -> Result<()> {
+/// Policy of every app profile, labelled for the kernel's accounting
+pub fn sepolicy_sources() -> Result<Vec<(String, PathBuf)>> {
     let path = Path::new(defs::PROFILE_SELINUX_DIR);
     if !path.exists() {
         log::info!("profile sepolicy dir not exists.");
-        return Ok(());
+        return Ok(vec![]);
     }
 
     let sepolicies =
         std::fs::read_dir(path).with_context(|| "profile sepolicy dir open failed.".to_string())?;
+    let mut sources = vec![];
     for sepolicy in sepolicies {
         let Ok(sepolicy) = sepolicy else {
             log::info!("profile sepolicy dir read failed.");
             continue;
         };
         let sepolicy = sepolicy.path();
-        if sepolicy::apply_file(&sepolicy).is_ok() {
-            log::info!("profile sepolicy applied: {:?}", sepolicy);
-        } else {
-            log::info!("profile sepolicy apply failed: {:?}", sepolicy);
-        }
+        let source = format!(
+            "profile:{}",
+            sepolicy.file_name().unwrap_or_default().to_string_lossy()
+        );
+        sources.push((source, sepolicy));
     }
-    Ok(())
+    sources.sort();
+    Ok(sources)
 }
@@ -1,3 +1,4 @@
+use crate::defs;
 use anyhow::{bail, Result};
 use derive_new::new;
 use nom::{
@@ -11,7 +12,19 @@ use nom::{
     sequence::Tuple,
     IResult, Parser,
 };
-use std::{ffi, path::Path, vec};
+use rayon::prelude::*;
+use std::{
+    collections::HashSet,
+    ffi,
+    path::{Path, PathBuf},
+    time::Instant,
+    vec,
+};
+
+#[cfg(feature = "sepolicy-bench")]
+mod bench;
+#[cfg(feature = "sepolicy-bench")]
+pub use bench::bench;
 
 type SeObject<'a> = Vec<&'a str>;
 
@@ -360,6 +373,8 @@ where
             statements.push(statement);
         } else if strict {
             bail!("Failed to parse policy statement: {}", line)
+        } else {
+            log::warn!("sepolicy: ignore unparsable statement: {trimmed_line}");
         }
     }
     Ok(statements)
@@ -377,7 +392,7 @@ const CMD_TYPE_TRANSITION: u32 = 7;
 const CMD_TYPE_CHANGE: u32 = 8;
 const CMD_GENFSCON: u32 = 9;
 
-#[derive(Debug, Default)]
+#[derive(Debug, Default, Clone, PartialEq, Eq, Hash)]
 enum PolicyObject {
     All, // for "*", stand for all objects, and is NULL in ffi
     One([u8; SEPOLICY_MAX_LEN]),
@@ -403,7 +418,7 @@ impl TryFrom<&str> for PolicyObject {
 /// allow domain1 domain2:file1 { read write }; would be expand to two atomic statement
 /// allow domain1 domain2:file1 read;allow domain1 domain2:file1 write;
 #[allow(clippy::too_many_arguments)]
-#[derive(Debug, new)]
+#[derive(Debug, new, Clone, PartialEq, Eq, Hash)]
 struct AtomicStatement {
     cmd: u32,
     subcmd: u32,
@@ -676,8 +691,8 @@ fn to_c_ptr(pol: &PolicyObject) -> *const ffi::c_char {
     }
 }
 
-impl From<AtomicStatement> for FfiPolicy {
-    fn from(policy: AtomicStatement) -> FfiPolicy {
+impl From<&AtomicStatement> for FfiPolicy {
+    fn from(policy: &AtomicStatement) -> FfiPolicy {
         FfiPolicy {
             cmd: policy.cmd,
             subcmd: policy.subcmd,
@@ -692,39 +707,169 @@ impl From<AtomicStatement> for FfiPolicy {
     }
 }
 
+/// Must match `MAX_SEPOL_BATCH` in kernel/selinux/rules.c
+const SEPOL_BATCH_MAX: usize = 256;
+/// Skip the AVC reset, a later batch of the same transaction will do it
+const SEPOL_BATCH_NO_RESET: u32 = 1 << 0;
+
+#[derive(Debug)]
+#[repr(C)]
+struct FfiPolicyBatch {
+    count: u32,
+    flags: u32,
+    rules: *const FfiPolicy,
+    status: *mut i32,
+    added: u32,
+    present: u32,
+    source: *const ffi::c_char,
+}
+
+#[derive(Debug, Default)]
+struct PushResult {
+    /// kernel status of every rule, 0 on success
+    status: Vec<i32>,
+    /// rules that modified the policy, only counted by batching kernels
+    added: u32,
+    /// rules that were already in effect
+    present: u32,
+}
+
+/// Push rules to the kernel in as few prctls as possible, the AVC is only reset
+/// once after the last batch, and not at all without `reset`. `source` labels
+/// the rules in the kernel's accounting, see `ksud sepolicy dump`.
 #[cfg(any(target_os = "linux", target_os = "android"))]
-fn apply_one_rule<'a>(statement: &'a PolicyStatement<'a>, strict: bool) -> Result<()> {
-    let policies: Vec<AtomicStatement> = statement.try_into()?;
+fn push_rules(rules: &[FfiPolicy], source: &str, reset: bool) -> PushResult {
+    let source = ffi::CString::new(source).unwrap_or_default();
+    let mut result = PushResult {
+        status: vec![0i32; rules.len()],
+        ..Default::default()
+    };
+    let batches = rules.len().div_ceil(SEPOL_BATCH_MAX);
 
-    for policy in policies {
-        if !rustix::process::ksu_set_policy(&FfiPolicy::from(policy)) {
-            log::warn!("apply rule: {:?} failed.", statement);
-            if strict {
-                return Err(anyhow::anyhow!("apply rule {:?} failed.", statement));
-            }
+    for (i, (chunk, chunk_status)) in rules
+        .chunks(SEPOL_BATCH_MAX)
+        .zip(result.status.chunks_mut(SEPOL_BATCH_MAX))
+        .enumerate()
+    {
+        let mut batch = FfiPolicyBatch {
+            count: chunk.len() as u32,
+            flags: if reset && i + 1 == batches {
+                0
+            } else {
+                SEPOL_BATCH_NO_RESET
+            },
+            rules: chunk.as_ptr(),
+            status: chunk_status.as_mut_ptr(),
+            added: 0,
+            present: 0,
+            source: source.as_ptr(),
+        };
+        let batched = crate::ksucalls::ksuctl(
+            crate::ksucalls::CMD_SET_SEPOLICY_BATCH,
+            std::ptr::addr_of_mut!(batch).cast(),
+            std::ptr::null_mut(),
+        );
+        if batched {
+            result.added += batch.added;
+            result.present += batch.present;
+            continue;
+        }
+        // older kernels don't know the batch command, one prctl per rule
+        for (rule, st) in chunk.iter().zip(chunk_status.iter_mut()) {
+            *st = if rustix::process::ksu_set_policy(rule) {
+                0
+            } else {
+                -1
+            };
         }
     }
 
-    Ok(())
+    result
 }
 
 #[cfg(not(any(target_os = "linux", target_os = "android")))]
-fn apply_one_rule<'a>(_statement: &'a PolicyStatement<'a>, _strict: bool) -> Result<()> {
+fn push_rules(_rules: &[FfiPolicy], _source: &str, _reset: bool) -> PushResult {
     unimplemented!()
 }
 
-pub fn live_patch(policy: &str) -> Result<()> {
-    let result = parse_sepolicy(policy.trim(), false)?;
-    for statement in result {
-        println!("{statement:?}");
-        apply_one_rule(&statement, false)?;
+fn apply_rules<'a>(
+    statements: &'a [PolicyStatement<'a>],
+    strict: bool,
+    source: &str,
+) -> Result<()> {
+    let mut atomics: Vec<AtomicStatement> = vec![];
+    let mut owners = vec![];
+    for (i, statement) in statements.iter().enumerate() {
+        let policies: Vec<AtomicStatement> = statement.try_into()?;
+        owners.extend(std::iter::repeat(i).take(policies.len()));
+        atomics.extend(policies);
+    }
+    if atomics.is_empty() {
+        return Ok(());
+    }
+
+    // FfiPolicy points into atomics, keep it alive until the kernel is done
+    let rules: Vec<FfiPolicy> = atomics.iter().map(FfiPolicy::from).collect();
+    let result = push_rules(&rules, source, true);
+    log::info!(
+        "sepolicy: {} rules pushed for {source}, {} new, {} already present",
+        rules.len(),
+        result.added,
+        result.present
+    );
+
+    let mut failed = None;
+    for (st, &owner) in result.status.iter().zip(owners.iter()) {
+        if *st != 0 && failed != Some(owner) {
+            log::warn!("apply rule: {:?} failed.", statements[owner]);
+            failed = Some(owner);
+            if strict {
+                bail!("apply rule {:?} failed.", statements[owner]);
+            }
+        }
     }
+
     Ok(())
 }
 
-pub fn apply_file<P: AsRef<Path>>(path: P) -> Result<()> {
+/// Apply sepolicy statements, `source` names their origin such as
+/// `module:<id>` or `profile:<package>` in the kernel's accounting.
+pub fn live_patch(policy: &str, source: &str) -> Result<()> {
+    let result = parse_sepolicy(policy.trim(), false)?;
+    for statement in &result {
+        log::debug!("{statement:?}");
+    }
+    apply_rules(&result, false, source)
+}
+
+pub fn apply_file<P: AsRef<Path>>(path: P, source: &str) -> Result<()> {
     let input = std::fs::read_to_string(path)?;
-    live_patch(&input)
+    live_patch(&input, source)
+}
+
+/// Print everything KernelSU added to the live policy, grouped by source with
+/// the policy growth each of them caused.
+pub fn dump() -> Result<()> {
+    let mut buf: Vec<u8> = vec![0; 64 * 1024];
+    loop {
+        let mut size = buf.len() as u32;
+        if !crate::ksucalls::ksuctl(
+            crate::ksucalls::CMD_GET_SEPOLICY_DUMP,
+            buf.as_mut_ptr().cast(),
+            std::ptr::addr_of_mut!(size).cast(),
+        ) {
+            bail!("sepolicy dump is not supported by the kernel");
+        }
+        // the reported size includes the terminating NUL
+        let size = size as usize;
+        if size <= buf.len() {
+            buf.truncate(size.saturating_sub(1));
+            break;
+        }
+        buf.resize(size, 0);
+    }
+    print!("{}", String::from_utf8_lossy(&buf));
+    Ok(())
 }
 
 pub fn check_rule(policy: &str) -> Result<()> {
@@ -737,3 +882,339 @@ pub fn check_rule(policy: &str) -> Result<()> {
     parse_sepolicy(policy.trim(), true)?;
     Ok(())
 }
+
+////////////////////////////////////////////////////////////////
+///  compiled rule cache
+///////////////////////////////////////////////////////////////
+
+// All rule sources applied at boot are compiled into one blob: every
+// statement parsed and expanded into atomic rules, rules already pushed by an
+// earlier source dropped. The blob is keyed by a hash of the sources, so a
+// boot with unchanged sources skips parsing entirely.
+//
+// Layout, integers little endian:
+//   magic[8] version:u32 key_len:u32 key sections:u32
+//   section: name_len:u32 name rules:u32 rule*
+//   rule:    cmd:u32 subcmd:u32 object*7
+//   object:  0 (none) | 1 (all) | 2 len:u8 bytes
+const SEPOLICY_CACHE_MAGIC: &[u8; 8] = b"KSUSEPOL";
+// 2: duplicates keep their last occurrence instead of the first
+const SEPOLICY_CACHE_VERSION: u32 = 2;
+
+/// Rules of one source after expansion and deduplication against the
+/// sources after it
+struct CompiledSource {
+    name: String,
+    rules: Vec<AtomicStatement>,
+}
+
+impl AtomicStatement {
+    fn objects(&self) -> [&PolicyObject; 7] {
+        [
+            &self.sepol1,
+            &self.sepol2,
+            &self.sepol3,
+            &self.sepol4,
+            &self.sepol5,
+            &self.sepol6,
+            &self.sepol7,
+        ]
+    }
+}
+
+impl std::fmt::Display for AtomicStatement {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}/{}", self.cmd, self.subcmd)?;
+        for obj in self.objects() {
+            match obj {
+                PolicyObject::All => write!(f, " *")?,
+                PolicyObject::One(buf) => {
+                    write!(f, " {}", String::from_utf8_lossy(object_bytes(buf)))?
+                }
+                PolicyObject::None => {}
+            }
+        }
+        Ok(())
+    }
+}
+
+fn object_bytes(buf: &[u8; SEPOLICY_MAX_LEN]) -> &[u8] {
+    let len = buf.iter().position(|&b| b == 0).unwrap_or(buf.len());
+    &buf[..len]
+}
+
+fn put_u32(out: &mut Vec<u8>, v: u32) {
+    out.extend_from_slice(&v.to_le_bytes());
+}
+
+fn put_bytes(out: &mut Vec<u8>, bytes: &[u8]) {
+    put_u32(out, bytes.len() as u32);
+    out.extend_from_slice(bytes);
+}
+
+fn encode_cache(key: &str, sources: &[CompiledSource]) -> Vec<u8> {
+    let mut out = Vec::new();
+    out.extend_from_slice(SEPOLICY_CACHE_MAGIC);
+    put_u32(&mut out, SEPOLICY_CACHE_VERSION);
+    put_bytes(&mut out, key.as_bytes());
+    put_u32(&mut out, sources.len() as u32);
+    for source in sources {
+        put_bytes(&mut out, source.name.as_bytes());
+        put_u32(&mut out, source.rules.len() as u32);
+        for rule in &source.rules {
+            put_u32(&mut out, rule.cmd);
+            put_u32(&mut out, rule.subcmd);
+            for obj in rule.objects() {
+                match obj {
+                    PolicyObject::None => out.push(0),
+                    PolicyObject::All => out.push(1),
+                    PolicyObject::One(buf) => {
+                        let bytes = object_bytes(buf);
+                        out.push(2);
+                        out.push(bytes.len() as u8);
+                        out.extend_from_slice(bytes);
+                    }
+                }
+            }
+        }
+    }
+    out
+}
+
+struct CacheReader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> CacheReader<'a> {
+    fn take(&mut self, len: usize) -> Result<&'a [u8]> {
+        anyhow::ensure!(self.data.len() >= len, "truncated sepolicy cache");
+        let (head, tail) = self.data.split_at(len);
+        self.data = tail;
+        Ok(head)
+    }
+
+    fn u8(&mut self) -> Result<u8> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        let bytes = self.take(4)?;
+        Ok(u32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+    }
+
+    fn bytes(&mut self) -> Result<&'a [u8]> {
+        let len = self.u32()? as usize;
+        self.take(len)
+    }
+
+    fn object(&mut self) -> Result<PolicyObject> {
+        match self.u8()? {
+            0 => Ok(PolicyObject::None),
+            1 => Ok(PolicyObject::All),
+            2 => {
+                let len = self.u8()? as usize;
+                anyhow::ensure!(len <= SEPOLICY_MAX_LEN, "policy object too long");
+                let mut buf = [0u8; SEPOLICY_MAX_LEN];
+                buf[..len].copy_from_slice(self.take(len)?);
+                Ok(PolicyObject::One(buf))
+            }
+            tag => bail!("invalid policy object tag {tag}"),
+        }
+    }
+}
+
+/// Decode a cache blob, None if it was built for other sources
+fn decode_cache(data: &[u8], key: &str) -> Result<Option<Vec<CompiledSource>>> {
+    let mut reader = CacheReader { data };
+    if reader.take(SEPOLICY_CACHE_MAGIC.len())? != SEPOLICY_CACHE_MAGIC
+        || reader.u32()? != SEPOLICY_CACHE_VERSION
+        || reader.bytes()? != key.as_bytes()
+    {
+        return Ok(None);
+    }
+    let count = reader.u32()?;
+    let mut sources = Vec::with_capacity(count as usize);
+    for _ in 0..count {
+        let name = String::from_utf8_lossy(reader.bytes()?).into_owned();
+        let len = reader.u32()? as usize;
+        let mut rules = Vec::with_capacity(len.min(reader.data.len()));
+        for _ in 0..len {
+            let cmd = reader.u32()?;
+            let subcmd = reader.u32()?;
+            rules.push(AtomicStatement::new(
+                cmd,
+                subcmd,
+                reader.object()?,
+                reader.object()?,
+                reader.object()?,
+                reader.object()?,
+                reader.object()?,
+                reader.object()?,
+                reader.object()?,
+            ));
+        }
+        sources.push(CompiledSource { name, rules });
+    }
+    Ok(Some(sources))
+}
+
+/// The cache key covers the name and content of every source in order
+fn cache_key(inputs: &[(String, String)]) -> String {
+    let mut data = Vec::new();
+    put_u32(&mut data, SEPOLICY_CACHE_VERSION);
+    for (name, content) in inputs {
+        put_bytes(&mut data, name.as_bytes());
+        put_bytes(&mut data, content.as_bytes());
+    }
+    sha256::digest(&data)
+}
+
+/// A statement that can't be parsed or expanded is logged and skipped, the
+/// rest of the source is still applied.
+fn compile_named_source(name: &str, content: &str) -> CompiledSource {
+    let statements = parse_sepolicy(content.trim(), false).unwrap_or_default();
+    let mut rules = vec![];
+    for statement in &statements {
+        let atomics: Result<Vec<AtomicStatement>> = statement.try_into();
+        match atomics {
+            Ok(atomics) => rules.extend(atomics),
+            Err(e) => log::warn!("sepolicy: {name}: rejected {statement:?}: {e}"),
+        }
+    }
+    CompiledSource {
+        name: name.to_string(),
+        rules,
+    }
+}
+
+/// Parse and expand every source, in parallel if asked to. The result is in
+/// input order either way, dedupe and the cache key depend on it.
+fn parse_sources(inputs: &[(String, String)], parallel: bool) -> Vec<CompiledSource> {
+    if parallel {
+        inputs
+            .par_iter()
+            .map(|(name, content)| compile_named_source(name, content))
+            .collect()
+    } else {
+        inputs
+            .iter()
+            .map(|(name, content)| compile_named_source(name, content))
+            .collect()
+    }
+}
+
+fn compile_sources(inputs: &[(String, String)]) -> Vec<CompiledSource> {
+    let start = Instant::now();
+    let mut sources = parse_sources(inputs, inputs.len() > 1);
+    let total: usize = sources.iter().map(|s| s.rules.len()).sum();
+    log::info!(
+        "sepolicy: parsed {} sources into {total} rules in {:?}",
+        sources.len(),
+        start.elapsed()
+    );
+
+    // Rules are applied in order, so only the last occurrence of a rule
+    // decides the final state: allow, deny, allow of the same rule has to end
+    // in allow. Keep that one and drop the earlier ones.
+    let start = Instant::now();
+    let mut seen = HashSet::with_capacity(total);
+    for source in sources.iter_mut().rev() {
+        let mut keep: Vec<bool> = source
+            .rules
+            .iter()
+            .rev()
+            .map(|rule| seen.insert(rule.clone()))
+            .collect();
+        keep.reverse();
+        let mut keep = keep.into_iter();
+        source.rules.retain(|_| keep.next().unwrap_or(true));
+    }
+    log::info!(
+        "sepolicy: {} unique rules after dedupe in {:?}",
+        seen.len(),
+        start.elapsed()
+    );
+
+    sources
+}
+
+fn load_or_compile(inputs: &[(String, String)]) -> Vec<CompiledSource> {
+    let key = cache_key(inputs);
+    let start = Instant::now();
+    match std::fs::read(defs::SEPOLICY_CACHE_PATH).map(|data| decode_cache(&data, &key)) {
+        Ok(Ok(Some(sources))) => {
+            log::info!("sepolicy: cache hit, loaded in {:?}", start.elapsed());
+            return sources;
+        }
+        Ok(Ok(None)) => log::info!("sepolicy: cache is stale, recompiling"),
+        Ok(Err(e)) => log::warn!("sepolicy: cache is corrupted: {e}"),
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => {}
+        Err(e) => log::warn!("sepolicy: read cache failed: {e}"),
+    }
+
+    let sources = compile_sources(inputs);
+    // write then rename, a torn cache must never be mistaken for a valid one
+    let tmp = format!("{}.tmp", defs::SEPOLICY_CACHE_PATH);
+    if let Err(e) = std::fs::write(&tmp, encode_cache(&key, &sources))
+        .and_then(|_| std::fs::rename(&tmp, defs::SEPOLICY_CACHE_PATH))
+    {
+        log::warn!("sepolicy: write cache failed: {e}");
+        let _ = std::fs::remove_file(&tmp);
+    }
+    sources
+}
+
+/// Drop the compiled rules, called whenever the set of active modules changes.
+/// The cache key catches any change to the sources anyway, this just saves the
+/// next boot from reading a stale blob.
+pub fn invalidate_cache() {
+    if let Err(e) = std::fs::remove_file(defs::SEPOLICY_CACHE_PATH) {
+        if e.kind() != std::io::ErrorKind::NotFound {
+            log::warn!("sepolicy: remove cache failed: {e}");
+        }
+    }
+}
+
+/// Apply every rule source at once from the compiled cache, `sources` are
+/// (label, path) pairs in the order they take precedence.
+pub fn apply_sources(sources: &[(String, PathBuf)]) -> Result<()> {
+    let inputs: Vec<(String, String)> = sources
+        .iter()
+        .filter_map(|(name, path)| match std::fs::read_to_string(path) {
+            Ok(content) => Some((name.clone(), content)),
+            Err(e) => {
+                log::warn!("sepolicy: read {} failed: {e}", path.display());
+                None
+            }
+        })
+        .collect();
+
+    let compiled = load_or_compile(&inputs);
+
+    let start = Instant::now();
+    let last = compiled.iter().rposition(|s| !s.rules.is_empty());
+    let (mut added, mut present, mut failed) = (0, 0, 0);
+    for (i, source) in compiled.iter().enumerate() {
+        if source.rules.is_empty() {
+            continue;
+        }
+        // FfiPolicy points into the compiled rules, which outlive the push
+        let rules: Vec<FfiPolicy> = source.rules.iter().map(FfiPolicy::from).collect();
+        let result = push_rules(&rules, &source.name, Some(i) == last);
+        added += result.added;
+        present += result.present;
+        for (st, rule) in result.status.iter().zip(source.rules.iter()) {
+            if *st != 0 {
+                log::warn!("sepolicy: {}: apply rule {rule} failed", source.name);
+                failed += 1;
+            }
+        }
+    }
+    log::info!(
+        "sepolicy: applied {} sources, {added} new, {present} already present, {failed} failed in {:?}",
+        compiled.len(),
+        start.elapsed()
+    );
+
+    Ok(())
+}
@@ -0,0 +1,137 @@
+// Parser benchmark behind `ksud debug sepolicy-bench`, only built with the
+// sepolicy-bench feature so it stays out of the binary shipped to devices:
+//
+//   cargo run --release --features sepolicy-bench -- debug sepolicy-bench
+
+use super::{parse_sepolicy, parse_sources};
+use anyhow::Result;
+use std::time::Instant;
+
+/// sepolicy.rule of a typical Magisk style module, `@` is replaced by a per
+/// module domain so modules don't dedupe against each other
+const MODULE_RULE_TEMPLATE: &str = "\
+# @ daemon
+type @ domain
+type @_exec file_type
+typeattribute @ mlstrustedsubject
+permissive @
+allow @ @_exec file { read open execute getattr map }
+allow @ system_file dir { search read open getattr }
+allow @ self capability { chown dac_override fowner setuid setgid }
+allow @ self process { fork sigchld signal getattr setsched }
+allow @ proc file { read open getattr }
+allow @ sysfs dir { search read open }
+allow @ sysfs file { read write open getattr }
+allow { system_server zygote } @ unix_stream_socket { connectto getattr }
+allow @ vendor_file file { read open execute getattr map }
+allow @ adb_data_file dir *
+dontaudit @ * * *
+type_transition init @_exec process @
+type_change @ devpts chr_file @_devpts
+genfscon proc @ proc_@
+";
+
+fn module_corpus(modules: usize) -> Vec<(String, String)> {
+    (0..modules)
+        .map(|i| {
+            let domain = format!("bench_module{i}");
+            (
+                format!("module:{domain}"),
+                MODULE_RULE_TEMPLATE.replace('@', &domain),
+            )
+        })
+        .collect()
+}
+
+/// Plain single object statements, one per line
+fn stress_corpus(lines: usize) -> String {
+    (0..lines)
+        .map(|i| format!("allow bench_src{} bench_tgt{} file read\n", i % 97, i))
+        .collect()
+}
+
+/// Statements whose brace sets expand into many atomic rules each
+fn brace_corpus(lines: usize) -> String {
+    (0..lines)
+        .map(|i| {
+            format!(
+                "allow {{ bench_a{i} bench_b{i} bench_c{i} }} {{ system_file vendor_file }} \
+                 {{ file dir lnk_file }} {{ read open getattr map }}\n"
+            )
+        })
+        .collect()
+}
+
+fn bench_corpus(name: &str, inputs: &[(String, String)], iterations: usize) {
+    let lines: usize = inputs.iter().map(|(_, c)| c.lines().count()).sum();
+    let per_iter = |start: Instant| start.elapsed() / iterations as u32;
+
+    let start = Instant::now();
+    let mut statements = 0;
+    for _ in 0..iterations {
+        statements = inputs
+            .iter()
+            .map(|(_, c)| parse_sepolicy(c.trim(), false).map_or(0, |s| s.len()))
+            .sum();
+    }
+    let parse = per_iter(start);
+
+    let start = Instant::now();
+    let mut sequential = vec![];
+    for _ in 0..iterations {
+        sequential = parse_sources(inputs, false);
+    }
+    let expand = per_iter(start);
+
+    let start = Instant::now();
+    let mut parallel = vec![];
+    for _ in 0..iterations {
+        parallel = parse_sources(inputs, true);
+    }
+    let expand_parallel = per_iter(start);
+
+    let rules: usize = sequential.iter().map(|s| s.rules.len()).sum();
+    let same_order = sequential.len() == parallel.len()
+        && sequential
+            .iter()
+            .zip(parallel.iter())
+            .all(|(a, b)| a.name == b.name && a.rules == b.rules);
+    let lines_per_sec = lines as f64 / parse.as_secs_f64().max(1e-9);
+
+    println!(
+        "{name}: {} files, {lines} lines, {statements} statements, {rules} rules",
+        inputs.len()
+    );
+    println!("  parse:             {parse:?} ({lines_per_sec:.0} lines/s)");
+    println!("  parse + expand:    {expand:?}");
+    println!(
+        "  parallel expand:   {expand_parallel:?} ({})",
+        if same_order {
+            "same output"
+        } else {
+            "OUTPUT DIFFERS"
+        }
+    );
+}
+
+/// Measure parser throughput over synthetic corpora, `ksud debug sepolicy-bench`
+pub fn bench(iterations: usize) -> Result<()> {
+    let iterations = iterations.max(1);
+    println!(
+        "{iterations} iterations, {} threads",
+        rayon::current_num_threads()
+    );
+
+    bench_corpus("modules", &module_corpus(64), iterations);
+    bench_corpus(
+        "stress",
+        &[("stress".to_string(), stress_corpus(10_000))],
+        iterations,
+    );
+    bench_corpus(
+        "brace",
+        &[("brace".to_string(), brace_corpus(1_000))],
+        iterations,
+    );
+    Ok(())
+}
@@ -0,0 +1,434 @@
+use java_properties::PropertiesIter;
+use log::{info, warn};
+use std::{
+    collections::HashMap,
+    io::Cursor,
+    path::PathBuf,
+    process::Child,
+    time::{Duration, Instant},
+};
+
+use crate::{boot_profile, defs, module::script_command, module_index::ModuleEntry};
+
+// Blocking stage scripts run one after another with no time limit by
+// default, so a single slow module holds up the boot. /data/adb/ksu/stage.prop
+// opts in to running them concurrently, with ordering hints from module.prop
+// and deadlines enforced by killing the script's process group:
+//
+//   mode=parallel          # default sequential, the one by one behaviour
+//   parallelism=4          # scripts running at the same time
+//   script_timeout=40      # seconds, default 0 for none
+//   stage_timeout=90       # seconds for the whole stage, default 0 for none
+//
+// parallelism and the timeouts only apply in parallel mode. Killed scripts
+// are marked as such in the boot profile.
+//
+// A module declares hints as comma separated module ids in its module.prop:
+//
+//   after=zygisk_foo       # start only once zygisk_foo's script finished
+//   before=bar,baz         # finish before the scripts of bar and baz start
+//
+// Hints only order scripts of the same stage, unknown ids are ignored and a
+// cycle is broken in module name order.
+
+const DEFAULT_PARALLELISM: usize = 4;
+const DEFAULT_SCRIPT_TIMEOUT: u64 = 0;
+const DEFAULT_STAGE_TIMEOUT: u64 = 0;
+/// only used when SIGCHLD can't be caught
+const POLL_INTERVAL: Duration = Duration::from_millis(10);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Mode {
+    Parallel,
+    Sequential,
+}
+
+#[derive(Debug)]
+pub struct Config {
+    pub mode: Mode,
+    pub parallelism: usize,
+    pub script_timeout: Option<Duration>,
+    pub stage_timeout: Option<Duration>,
+}
+
+fn read_props(path: &std::path::Path) -> HashMap<String, String> {
+    let mut props = HashMap::new();
+    if let Ok(content) = std::fs::read(path) {
+        let result = PropertiesIter::new_with_encoding(Cursor::new(content), encoding_rs::UTF_8)
+            .read_into(|k, v| {
+                props.insert(k, v);
+            });
+        if let Err(e) = result {
+            warn!("parse {} failed: {e}", path.display());
+        }
+    }
+    props
+}
+
+fn timeout(props: &HashMap<String, String>, key: &str, default: u64) -> Option<Duration> {
+    let secs = props
+        .get(key)
+        .and_then(|v| v.trim().parse().ok())
+        .unwrap_or(default);
+    (secs > 0).then(|| Duration::from_secs(secs))
+}
+
+impl Config {
+    pub fn load() -> Config {
+        let props = read_props(std::path::Path::new(defs::STAGE_CONFIG_PATH));
+        let mode = match props.get("mode").map(|m| m.trim()) {
+            Some("parallel") => Mode::Parallel,
+            _ => Mode::Sequential,
+        };
+        let parallelism = props
+            .get("parallelism")
+            .and_then(|v| v.trim().parse().ok())
+            .unwrap_or(DEFAULT_PARALLELISM)
+            .max(1);
+        Config {
+            mode,
+            parallelism,
+            script_timeout: timeout(&props, "script_timeout", DEFAULT_SCRIPT_TIMEOUT),
+            stage_timeout: timeout(&props, "stage_timeout", DEFAULT_STAGE_TIMEOUT),
+        }
+    }
+}
+
+pub struct Script {
+    pub id: String,
+    pub path: PathBuf,
+    /// indices of earlier scripts that have to finish first
+    after: Vec<usize>,
+}
+
+fn split_ids(v: Option<&String>) -> Vec<String> {
+    v.map(|v| {
+        v.split([',', ' '])
+            .filter(|s| !s.is_empty())
+            .map(str::to_string)
+            .collect()
+    })
+    .unwrap_or_default()
+}
+
+/// Scripts of `stage` in the order they may be started: hints respected,
+/// module name order otherwise
+pub fn order_scripts(stage: &str, modules: &[ModuleEntry]) -> Vec<Script> {
+    let count = modules.len();
+    let mut ids = Vec::with_capacity(count);
+    let mut hints = Vec::with_capacity(count);
+    for module in modules {
+        let props = read_props(&module.path.join("module.prop"));
+        let id = props
+            .get("id")
+            .filter(|id| !id.is_empty())
+            .cloned()
+            .unwrap_or_else(|| {
+                module
+                    .path
+                    .file_name()
+                    .unwrap_or_default()
+                    .to_string_lossy()
+                    .into_owned()
+            });
+        ids.push(id);
+        hints.push((
+            split_ids(props.get("after")),
+            split_ids(props.get("before")),
+        ));
+    }
+    let index: HashMap<&str, usize> = ids
+        .iter()
+        .enumerate()
+        .map(|(i, id)| (id.as_str(), i))
+        .collect();
+
+    // preds[i]: scripts that must finish before script i starts
+    let mut preds = vec![vec![]; count];
+    for (i, (after, before)) in hints.iter().enumerate() {
+        for id in after {
+            if let Some(&j) = index.get(id.as_str()) {
+                preds[i].push(j);
+            }
+        }
+        for id in before {
+            if let Some(&j) = index.get(id.as_str()) {
+                preds[j].push(i);
+            }
+        }
+    }
+
+    // Kahn's algorithm, always taking the first ready script in name order;
+    // when only a cycle is left its first member goes ahead regardless
+    let mut order = Vec::with_capacity(count);
+    let mut placed = vec![false; count];
+    while order.len() < count {
+        let ready =
+            (0..count).find(|&i| !placed[i] && preds[i].iter().all(|&p| placed[p] || p == i));
+        let next = ready.unwrap_or_else(|| {
+            let i = (0..count).find(|&i| !placed[i]).unwrap();
+            warn!("{stage}: ordering cycle at {}, hints ignored", ids[i]);
+            i
+        });
+        placed[next] = true;
+        order.push(next);
+    }
+
+    let mut position = vec![0; count];
+    for (pos, &i) in order.iter().enumerate() {
+        position[i] = pos;
+    }
+    order
+        .iter()
+        .map(|&i| {
+            let mut after: Vec<usize> = preds[i]
+                .iter()
+                .map(|&p| position[p])
+                .filter(|&p| p < position[i])
+                .collect();
+            after.sort_unstable();
+            after.dedup();
+            Script {
+                id: ids[i].clone(),
+                path: modules[i].path.join(format!("{stage}.sh")),
+                after,
+            }
+        })
+        .collect()
+}
+
+#[cfg(unix)]
+fn kill_group(child: &mut Child) {
+    // scripts run in their own process group, take down whatever they started
+    unsafe {
+        libc::kill(-(child.id() as libc::pid_t), libc::SIGKILL);
+    }
+    let _ = child.wait();
+}
+
+#[cfg(not(unix))]
+fn kill_group(child: &mut Child) {
+    let _ = child.kill();
+    let _ = child.wait();
+}
+
+// Wakes the scheduler when a child exits, the handler writes a byte into a
+// pipe the scheduler polls with the time left until the nearest deadline.
+// waitpid(-1) is no option: it would reap the children std::process::Child
+// waits for, and other children of ksud like the boot log catchers.
+#[cfg(unix)]
+mod child_waker {
+    use std::sync::atomic::{AtomicI32, Ordering};
+    use std::time::Duration;
+
+    static WAKE_FD: AtomicI32 = AtomicI32::new(-1);
+
+    extern "C" fn on_sigchld(_: libc::c_int) {
+        let fd = WAKE_FD.load(Ordering::Relaxed);
+        if fd >= 0 {
+            // a full pipe already has a wakeup pending
+            unsafe { libc::write(fd, b"c".as_ptr().cast(), 1) };
+        }
+    }
+
+    pub struct ChildWaker {
+        pipe: [libc::c_int; 2],
+        old: libc::sigaction,
+    }
+
+    impl ChildWaker {
+        pub fn install() -> Option<ChildWaker> {
+            let mut pipe = [-1; 2];
+            if unsafe { libc::pipe2(pipe.as_mut_ptr(), libc::O_CLOEXEC | libc::O_NONBLOCK) } != 0 {
+                return None;
+            }
+            WAKE_FD.store(pipe[1], Ordering::Relaxed);
+
+            let mut old: libc::sigaction = unsafe { std::mem::zeroed() };
+            let installed = unsafe {
+                let mut action: libc::sigaction = std::mem::zeroed();
+                action.sa_sigaction = on_sigchld as usize;
+                action.sa_flags = libc::SA_RESTART | libc::SA_NOCLDSTOP;
+                libc::sigemptyset(&mut action.sa_mask);
+                libc::sigaction(libc::SIGCHLD, &action, &mut old) == 0
+            };
+            if !installed {
+                WAKE_FD.store(-1, Ordering::Relaxed);
+                unsafe {
+                    libc::close(pipe[0]);
+                    libc::close(pipe[1]);
+                }
+                return None;
+            }
+            Some(ChildWaker { pipe, old })
+        }
+
+        /// Block until a child exited or `timeout` passed, None waits forever
+        pub fn wait(&self, timeout: Option<Duration>) {
+            let mut fd = libc::pollfd {
+                fd: self.pipe[0],
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            let ms = timeout.map_or(-1, |t| {
+                // round up, waking before the deadline only costs a loop
+                t.as_millis()
+                    .saturating_add(1)
+                    .min(libc::c_int::MAX as u128) as libc::c_int
+            });
+            // the signal usually interrupts poll with EINTR before the byte
+            // is seen, drain the pipe in any case
+            unsafe { libc::poll(&mut fd, 1, ms) };
+            let mut buf = [0u8; 64];
+            while unsafe { libc::read(self.pipe[0], buf.as_mut_ptr().cast(), buf.len()) } > 0 {}
+        }
+    }
+
+    impl Drop for ChildWaker {
+        fn drop(&mut self) {
+            unsafe {
+                libc::sigaction(libc::SIGCHLD, &self.old, std::ptr::null_mut());
+            }
+            WAKE_FD.store(-1, Ordering::Relaxed);
+            unsafe {
+                libc::close(self.pipe[0]);
+                libc::close(self.pipe[1]);
+            }
+        }
+    }
+}
+
+#[cfg(not(unix))]
+mod child_waker {
+    use std::time::Duration;
+
+    pub struct ChildWaker;
+
+    impl ChildWaker {
+        pub fn install() -> Option<ChildWaker> {
+            None
+        }
+
+        pub fn wait(&self, _timeout: Option<Duration>) {}
+    }
+}
+
+struct Running {
+    index: usize,
+    child: Child,
+    start: Instant,
+    start_ns: u64,
+}
+
+/// Run the scripts of a blocking stage, returns once all of them finished or
+/// were killed
+pub fn run(stage: &str, scripts: Vec<Script>, config: &Config) {
+    let stage_start = Instant::now();
+    let mut started = vec![false; scripts.len()];
+    let mut finished = vec![false; scripts.len()];
+    let mut running: Vec<Running> = vec![];
+    let mut killed = 0;
+    let waker = child_waker::ChildWaker::install();
+    if waker.is_none() {
+        warn!("{stage}: catch SIGCHLD failed, polling");
+    }
+
+    loop {
+        while running.len() < config.parallelism {
+            let Some(index) = (0..scripts.len())
+                .find(|&i| !started[i] && scripts[i].after.iter().all(|&p| finished[p]))
+            else {
+                break;
+            };
+            let script = &scripts[index];
+            started[index] = true;
+            info!("{stage}: exec {}", script.path.display());
+            match script_command(&script.path).spawn() {
+                Ok(child) => running.push(Running {
+                    index,
+                    child,
+                    start: Instant::now(),
+                    start_ns: boot_profile::now_ns(),
+                }),
+                Err(e) => {
+                    warn!("{stage}: exec {} failed: {e}", script.path.display());
+                    finished[index] = true;
+                }
+            }
+        }
+
+        if running.is_empty() {
+            break;
+        }
+
+        let before = running.len();
+        running.retain_mut(|r| {
+            let id = &scripts[r.index].id;
+            let name = format!("{stage}:{id}");
+            match r.child.try_wait() {
+                Ok(Some(status)) => {
+                    info!("{stage}: {id} {status} in {:?}", r.start.elapsed());
+                    boot_profile::record(name, r.start_ns);
+                }
+                Ok(None) if config.script_timeout.is_some_and(|t| r.start.elapsed() > t) => {
+                    warn!(
+                        "{stage}: {id} timed out after {:?}, killed",
+                        r.start.elapsed()
+                    );
+                    kill_group(&mut r.child);
+                    killed += 1;
+                    boot_profile::record_killed(name, r.start_ns);
+                }
+                Ok(None) => return true,
+                Err(e) => {
+                    warn!("{stage}: wait {id} failed: {e}");
+                    boot_profile::record(name, r.start_ns);
+                }
+            }
+            finished[r.index] = true;
+            false
+        });
+
+        if config
+            .stage_timeout
+            .is_some_and(|t| stage_start.elapsed() > t)
+        {
+            for r in &mut running {
+                let id = &scripts[r.index].id;
+                warn!("{stage}: stage timed out, killing {id}");
+                kill_group(&mut r.child);
+                killed += 1;
+                boot_profile::record_killed(format!("{stage}:{id}"), r.start_ns);
+            }
+            let skipped = started.iter().filter(|s| !**s).count();
+            if skipped > 0 {
+                warn!("{stage}: stage timed out, {skipped} scripts not started");
+            }
+            break;
+        }
+
+        if running.len() == before {
+            // sleep until a child exits or the nearest deadline passes
+            let now = Instant::now();
+            let script_deadline = config
+                .script_timeout
+                .and_then(|t| running.iter().map(|r| r.start + t).min());
+            let stage_deadline = config.stage_timeout.map(|t| stage_start + t);
+            let timeout = script_deadline
+                .into_iter()
+                .chain(stage_deadline)
+                .min()
+                .map(|deadline| deadline.saturating_duration_since(now));
+            match &waker {
+                Some(waker) => waker.wait(timeout),
+                None => std::thread::sleep(POLL_INTERVAL),
+            }
+        }
+    }
+
+    info!(
+        "{stage}: {} scripts in {:?}, {killed} killed",
+        scripts.len(),
+        stage_start.elapsed()
+    );
+}
@@ -303,12 +303,204 @@ pub fn uninstall(magiskboot_path: Option<PathBuf>) -> Result<()> {
     Ok(())
 }
 
-// TODO: use libxcp to improve the speed if cross's MSRV is 1.70
+/// How copy_sparse_file copied a file
+#[derive(Debug)]
+pub struct CopyStats {
+    pub method: &'static str,
+    /// bytes in the data segments of the source, holes are never read
+    pub data_bytes: u64,
+}
+
 pub fn copy_sparse_file<P: AsRef<Path>, Q: AsRef<Path>>(
     src: P,
     dst: Q,
     punch_hole: bool,
 ) -> Result<()> {
+    copy_sparse_file_stats(src, dst, punch_hole).map(|_| ())
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub fn copy_sparse_file_stats<P: AsRef<Path>, Q: AsRef<Path>>(
+    src: P,
+    dst: Q,
+    punch_hole: bool,
+) -> Result<CopyStats> {
+    copy_sparse_file_legacy(src, dst, punch_hole)
+}
+
+/// Copy the data segments of `src` found by SEEK_DATA/SEEK_HOLE, holes stay
+/// holes. A reflink is tried first and copy_file_range lets the kernel move
+/// the data. With `punch_hole` every zero block inside the data segments is
+/// dropped too, which needs the data in userspace.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn copy_sparse_file_stats<P: AsRef<Path>, Q: AsRef<Path>>(
+    src: P,
+    dst: Q,
+    punch_hole: bool,
+) -> Result<CopyStats> {
+    let src_file = File::open(src.as_ref())?;
+    let dst_file = OpenOptions::new()
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(dst.as_ref())?;
+    let len = src_file.metadata()?.len();
+    let data: Vec<_> = src_file
+        .scan_chunks()?
+        .into_iter()
+        .filter(|segment| matches!(segment.segment_type, SegmentType::Data))
+        .map(|segment| (segment.start, segment.end))
+        .collect();
+    // the logical size of a sparse image is no measure of the work done
+    let data_bytes = data.iter().map(|(start, end)| end - start).sum();
+
+    // shared extents keep whatever zero blocks the source has allocated
+    if !punch_hole && rustix::fs::ioctl_ficlone(&dst_file, &src_file).is_ok() {
+        return Ok(CopyStats {
+            method: "reflink",
+            data_bytes,
+        });
+    }
+
+    dst_file.set_len(len)?;
+
+    let mut stats = CopyStats {
+        method: if punch_hole {
+            "read/write, zero blocks skipped"
+        } else {
+            "copy_file_range"
+        },
+        data_bytes,
+    };
+    // only allocated once the data has to pass through userspace
+    let mut buffer = vec![];
+    for (start, end) in data {
+        let copied = if punch_hole {
+            0
+        } else {
+            copy_range_offload(&src_file, &dst_file, start, end)?
+        };
+        if start + copied == end {
+            continue;
+        }
+        if buffer.is_empty() {
+            buffer = vec![0u8; COPY_BUFFER_SIZE];
+        }
+        if punch_hole {
+            copy_range_skip_zero(&src_file, &dst_file, start, end, &mut buffer)?;
+        } else {
+            stats.method = "read/write";
+            copy_range_buffered(&src_file, &dst_file, start + copied, end, &mut buffer)?;
+        }
+    }
+
+    Ok(stats)
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+const COPY_BUFFER_SIZE: usize = 1 << 20;
+/// granularity of holes punched into the copy, a page is the smallest
+/// block size of the filesystems the images live on
+#[cfg(any(target_os = "linux", target_os = "android"))]
+const ZERO_BLOCK_SIZE: usize = 4096;
+
+/// OR-folding 16 bytes at a time without an early exit compiles to vector
+/// instructions, a block is small enough that exiting early gains nothing
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn is_zero(buf: &[u8]) -> bool {
+    let (head, body, tail) = unsafe { buf.align_to::<u128>() };
+    head.iter().chain(tail).all(|&b| b == 0) && body.iter().fold(0, |acc, &w| acc | w) == 0
+}
+
+/// Copy in kernel as far as copy_file_range goes, returns the bytes copied.
+/// Less than the range means the rest has to be copied by hand.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn copy_range_offload(src: &File, dst: &File, start: u64, end: u64) -> Result<u64> {
+    use rustix::io::Errno;
+
+    let (mut off_in, mut off_out) = (start, start);
+    while off_in < end {
+        let len = std::cmp::min(end - off_in, 1 << 30) as usize;
+        match rustix::fs::copy_file_range(src, Some(&mut off_in), dst, Some(&mut off_out), len) {
+            std::result::Result::Ok(0) => break,
+            std::result::Result::Ok(_) => {}
+            // not across these filesystems, or not on this kernel
+            Err(Errno::NOSYS | Errno::XDEV | Errno::INVAL | Errno::OPNOTSUPP) => break,
+            Err(e) => return Err(e.into()),
+        }
+    }
+    Ok(off_in - start)
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn copy_range_buffered(
+    src: &File,
+    dst: &File,
+    start: u64,
+    end: u64,
+    buffer: &mut [u8],
+) -> Result<()> {
+    use std::os::unix::fs::FileExt;
+
+    let mut offset = start;
+    while offset < end {
+        let len = std::cmp::min(buffer.len() as u64, end - offset) as usize;
+        let read = src.read_at(&mut buffer[..len], offset)?;
+        if read == 0 {
+            break;
+        }
+        dst.write_all_at(&buffer[..read], offset)?;
+        offset += read as u64;
+    }
+    Ok(())
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn copy_range_skip_zero(
+    src: &File,
+    dst: &File,
+    start: u64,
+    end: u64,
+    buffer: &mut [u8],
+) -> Result<()> {
+    use std::os::unix::fs::FileExt;
+
+    let mut offset = start;
+    while offset < end {
+        let len = std::cmp::min(buffer.len() as u64, end - offset) as usize;
+        let read = src.read_at(&mut buffer[..len], offset)?;
+        if read == 0 {
+            break;
+        }
+        // write runs of non zero blocks, zero blocks stay holes in dst
+        let data = &buffer[..read];
+        let mut run = None;
+        for (i, block) in data.chunks(ZERO_BLOCK_SIZE).enumerate() {
+            let pos = i * ZERO_BLOCK_SIZE;
+            match (is_zero(block), run) {
+                (false, None) => run = Some(pos),
+                (true, Some(run_start)) => {
+                    dst.write_all_at(&data[run_start..pos], offset + run_start as u64)?;
+                    run = None;
+                }
+                _ => {}
+            }
+        }
+        if let Some(run_start) = run {
+            dst.write_all_at(&data[run_start..], offset + run_start as u64)?;
+        }
+        offset += read as u64;
+    }
+    Ok(())
+}
+
+/// The original 4 KiB read/seek/write loop, kept as the baseline of
+/// `ksud debug xcp --compare` and for platforms without the calls above
+pub fn copy_sparse_file_legacy<P: AsRef<Path>, Q: AsRef<Path>>(
+    src: P,
+    dst: Q,
+    punch_hole: bool,
+) -> Result<CopyStats> {
     let mut src_file = File::open(src.as_ref())?;
     let mut dst_file = OpenOptions::new()
         .write(true)
@@ -318,11 +510,13 @@ pub fn copy_sparse_file<P: AsRef<Path>, Q: AsRef<Path>>(
 
     dst_file.set_len(src_file.metadata()?.len())?;
 
+    let mut data_bytes = 0;
     let segments = src_file.scan_chunks()?;
     for segment in segments {
         if let SegmentType::Data = segment.segment_type {
             let start = segment.start;
             let end = segment.end;
+            data_bytes += end - start;
 
             src_file.seek(SeekFrom::Start(start))?;
             dst_file.seek(SeekFrom::Start(start))?;
@@ -351,7 +545,10 @@ pub fn copy_sparse_file<P: AsRef<Path>, Q: AsRef<Path>>(
         }
     }
 
-    Ok(())
+    Ok(CopyStats {
+        method: "legacy read/seek/write",
+        data_bytes,
+    })
 }
 
 #[cfg(any(target_os = "linux", target_os = "android"))]